@@ -20,30 +20,67 @@
 
 #include "ir/ir.h"
 #include "fcontrol.h"
+#include "frontends/p4/methodInstance.h"
 
 namespace FPGA {
 
+// One P4 statement lowered to bluespec, with the P4 locations it reads and
+// writes, used to split an action into Engine stages.
+struct ActionStmt {
+  std::vector<cstring> lines;
+  std::set<cstring> reads;
+  std::set<cstring> writes;
+  // header and metadata struct locals the statement uses
+  std::set<cstring> locals;
+  std::set<cstring> stores;
+  // wide add/sub or multiply, not chained with another one in a stage
+  bool dsp = false;
+  // waits for a register response, starts a new stage
+  bool starts_stage = false;
+};
+
+// Header or metadata struct copied into a local at the start of a stage and
+// written back at its end.
+struct ActionLocal {
+  std::vector<cstring> load;
+  cstring store;
+};
+
 class ActionCodeGen : public Inspector {
  public:
-  ActionCodeGen(FPGAControl* control, BSVProgram& bsv, CodeBuilder* builder) : 
+  ActionCodeGen(FPGAControl* control, BSVProgram& bsv, CodeBuilder* builder) :
     control(control), bsv(bsv), builder(builder) {}
   bool preorder(const IR::AssignmentStatement* stmt) override;
-  bool preorder(const IR::Expression* expression) override;
-  bool preorder(const IR::MethodCallExpression* expression) override;
+  bool preorder(const IR::MethodCallStatement* stmt) override;
+  bool preorder(const IR::Declaration_Variable* decl) override;
+  bool preorder(const IR::BlockStatement* stmt) override;
+  bool preorder(const IR::IfStatement* stmt) override;
+  bool preorder(const IR::Statement* stmt) override;
   void postorder(const IR::P4Action* action) override;
-  bool isDropAction(const IR::P4Action* action);
-  bool isNoAction(const IR::P4Action* action);
- private:
+  // bluespec for a P4 location, registers the locals it needs in 'stmt'
+  cstring location(const IR::Expression* expr, ActionStmt* stmt, bool write);
+  cstring param(const IR::PathExpression* path, ActionStmt* stmt);
   FPGAControl* control;
+ private:
   BSVProgram & bsv;
   CodeBuilder* builder;
-  cstring table_name;
-  cstring table_type;
-  void emitModifyAction(const IR::P4Action* action);
-  void emitNoAction(const IR::P4Action* action);
-  void emitDropAction(const IR::P4Action* action);
-  void emitCpuRspRule(const IR::P4Action* action);
-  void emitActionBegin(const IR::P4Action* action);
+  std::vector<ActionStmt> stmts;
+  std::map<cstring, ActionLocal> locals;
+  // action variables and their bluespec type, carried from stage to stage
+  std::map<cstring, cstring> variables;
+  // registers read or written by an access that was not fused
+  std::set<cstring> reg_reads;
+  std::set<cstring> reg_writes;
+  cstring headerLocal(const IR::Member* hdr, ActionStmt* stmt);
+  void assign(const IR::Expression* left, cstring value, ActionStmt* s);
+  const P4::ExternMethod* registerCall(const IR::StatOrDecl* stmt) const;
+  void registerAccess(cstring reg, cstring op, const IR::Expression* index,
+                      const IR::Expression* data, const IR::Expression* cmp,
+                      const IR::Expression* out);
+  bool fuseRegister(const IR::IndexedVector<IR::StatOrDecl>& components, size_t i, size_t* end);
+  std::vector<std::vector<const ActionStmt*>> schedule() const;
+  void emitStage(cstring fn, int idx, int count, cstring param_type, cstring tag, bool has_params,
+                 cstring vars_type, const std::vector<const ActionStmt*>& stage);
 };
 
 }  // namespace FPGA
@@ -2,6 +2,7 @@
 #ifndef EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_BACKEND_H_
 #define EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_BACKEND_H_
 
+#include <boost/filesystem/path.hpp>
 #include "foptions.h"
 #include "ir/ir.h"
 #include "bsvprogram.h"
@@ -9,12 +10,19 @@
 
 namespace FPGA {
 
+class FPGAProgram;
+
+bool write_if_changed(const boost::filesystem::path& path, cstring content);
 void run_fpga_backend(const FPGAOptions& options, const IR::ToplevelBlock* toplevel,
-                      P4::ReferenceMap* refMap, P4::TypeMap* typeMap);
+                      P4::ReferenceMap* refMap, P4::TypeMap* typeMap,
+                      FPGA::Profiler* profgen = nullptr);
 
 void generate_partition(const FPGAOptions& options, const IR::P4Program* program, cstring idx);
+void generate_partition_metadata(const FPGAOptions& options, const std::map<cstring, int>& fields, cstring idx);
+void generate_partition_report(const FPGAOptions& options, FPGA::Partitioner* partgen);
 void generate_table_profile(const FPGAOptions& options, FPGA::Profiler* profile);
 void generate_metadata_profile(const IR::P4Program* program);
+void generate_report(const FPGAOptions& options, FPGAProgram* program, FPGA::Profiler* profgen);
 
 }  // namespace FPGA
 
@@ -3,53 +3,186 @@
 #ifndef P4FPGA_INCLUDE_BSVPROGRAM_H_
 #define P4FPGA_INCLUDE_BSVPROGRAM_H_
 
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
 #include "ir/ir.h"
 #include "lib/sourceCodeBuilder.h"
 #include "frontends/p4/typeMap.h"
 
 namespace FPGA {
 
+namespace Format {
+
+// conversion spec of the directive starting at fmt[0] == '%', e.g. "%04x"
+struct Spec {
+  char flags[8];
+  int width = 0;
+  char conv = 's';
+};
+
+inline const char* parseSpec(const char* fmt, Spec* spec) {
+  int n = 0;
+  ++fmt;
+  while (*fmt == '-' || *fmt == '0' || *fmt == '+' || *fmt == ' ' || *fmt == '#') {
+    if (n < 7) spec->flags[n++] = *fmt;
+    ++fmt;
+  }
+  spec->flags[n] = '\0';
+  while (*fmt >= '0' && *fmt <= '9')
+    spec->width = spec->width * 10 + (*fmt++ - '0');
+  BUG_CHECK(*fmt != '\0', "truncated format directive");
+  spec->conv = *fmt;
+  return fmt + 1;
+}
+
+inline void put(std::string* out, const Spec& spec, const char* v, size_t len) {
+  bool left = strchr(spec.flags, '-') != nullptr;
+  size_t fill = spec.width > static_cast<int>(len) ? spec.width - len : 0;
+  if (!left) out->append(fill, ' ');
+  out->append(v, len);
+  if (left) out->append(fill, ' ');
+}
+
+inline void put(std::string* out, const Spec& spec, const char* v) {
+  if (v == nullptr) v = "(null)";
+  put(out, spec, v, strlen(v));
+}
+inline void put(std::string* out, const Spec& spec, const std::string& v) {
+  put(out, spec, v.data(), v.size());
+}
+inline void put(std::string* out, const Spec& spec, cstring v) {
+  put(out, spec, v.c_str());
+}
+inline void put(std::string* out, const Spec& spec, char v) {
+  out->push_back(v);
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value>::type
+put(std::string* out, const Spec& spec, T v) {
+  char fmt[16], buf[32];
+  char conv = (spec.conv == 's') ? 'd' : spec.conv;
+  bool is_signed = std::is_signed<T>::value && conv != 'x' && conv != 'X' && conv != 'u';
+  if (!is_signed && conv == 'd') conv = 'u';
+  snprintf(fmt, sizeof(fmt), "%%%s%dll%c", spec.flags, spec.width, conv);
+  if (is_signed)
+    snprintf(buf, sizeof(buf), fmt, static_cast<long long>(v));
+  else
+    snprintf(buf, sizeof(buf), fmt, static_cast<unsigned long long>(v));
+  out->append(buf);
+}
+
+// anything else that can be streamed, e.g. IR::ID or enums
+template <typename T>
+typename std::enable_if<!std::is_integral<T>::value>::type
+put(std::string* out, const Spec& spec, const T& v) {
+  std::ostringstream s;
+  s << v;
+  put(out, spec, s.str());
+}
+
+// copy literal text up to the next directive, return it or nullptr at end
+inline const char* literal(std::string* out, const char* fmt) {
+  while (*fmt != '\0') {
+    if (*fmt == '%') {
+      if (*(fmt + 1) != '%') return fmt;
+      out->push_back('%');
+      fmt += 2;
+    } else {
+      out->push_back(*fmt++);
+    }
+  }
+  return nullptr;
+}
+
+inline void format(std::string* out, const char* fmt) {
+  fmt = literal(out, fmt);
+  BUG_CHECK(fmt == nullptr, "too few arguments for format directive %1%", fmt);
+}
+
+template <typename TValue, typename... TArgs>
+void format(std::string* out, const char* fmt, TValue&& arg, TArgs&&... args) {
+  fmt = literal(out, fmt);
+  BUG_CHECK(fmt != nullptr, "too many arguments for format string");
+  Spec spec;
+  fmt = parseSpec(fmt, &spec);
+  put(out, spec, std::forward<TValue>(arg));
+  format(out, fmt, std::forward<TArgs>(args)...);
+}
+
+// number of directives in a format string, "%%" is not one
+constexpr int directives(const char* fmt) {
+  return (*fmt == '\0') ? 0
+       : (*fmt == '%' && *(fmt + 1) == '%') ? directives(fmt + 2)
+       : (*fmt == '%') ? 1 + directives(fmt + 1)
+       : directives(fmt + 1);
+}
+
+template <int Directives, int Args>
+struct Check {
+  static_assert(Directives == Args, "format directives do not match the arguments");
+  static constexpr bool ok = true;
+};
+
+}  // namespace Format
+
+// number of arguments of a macro, up to 24
+#define FORMAT_NARGS(...) FORMAT_NARGS_(__VA_ARGS__, 24, 23, 22, 21, 20, 19, 18, 17, \
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define FORMAT_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, \
+    _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, N, ...) N
+#define FORMAT_FIRST(...) FORMAT_FIRST_(__VA_ARGS__, unused)
+#define FORMAT_FIRST_(fmt, ...) fmt
+#define FORMAT_CHECK(...) ::FPGA::Format::Check< \
+    ::FPGA::Format::directives(FORMAT_FIRST(__VA_ARGS__)), FORMAT_NARGS(__VA_ARGS__) - 1>::ok
+
+// append_line and append_format take a string literal format, the number of
+// its directives is checked against the arguments at compile time
+#define append_line(...) append_line_checked<FORMAT_CHECK(__VA_ARGS__)>(__VA_ARGS__)
+#define append_format(...) append_format_checked<FORMAT_CHECK(__VA_ARGS__)>(__VA_ARGS__)
+
+// Lines are formatted into a scratch buffer that is reused for the whole
+// file, then appended to the source builder, so no format object is built
+// per line. Directives are printf-like (%s, %d, %x, with flags and width)
+// and accept any argument that can be streamed; such arguments still go
+// through an ostringstream.
 class CodeBuilder : public Util::SourceCodeBuilder {
  public:
-    explicit CodeBuilder() {}
+    CodeBuilder() { scratch.reserve(1024); }
 
-    template <typename... TArgs>
-    void append_line(const char* fmt, TArgs&&... args);
+    template <bool Checked, typename... TArgs>
+    void append_line_checked(const char* fmt, TArgs&&... args);
 
-    template <typename... TArgs>
-    void append_format(const char* fmt, TArgs&&... args);
+    template <bool Checked, typename... TArgs>
+    void append_format_checked(const char* fmt, TArgs&&... args);
 
     void incr_indent() { increaseIndent(); }
     void decr_indent() { decreaseIndent(); }
 
-    template <typename TValue, typename... TArgs>
-      std::string format_string(boost::format& message, TValue&& arg, TArgs&&... args);
-    std::string format_string(boost::format& message) { return message.str(); };
+ private:
+    std::string scratch;
 };
 
-template <typename TValue, typename... TArgs>
-  std::string CodeBuilder::format_string(boost::format& message, TValue&& arg, TArgs&&... args) {
-  message % std::forward<TValue>(arg);
-  return format_string(message, std::forward<TArgs>(args)...);
+template <bool Checked, typename... TArgs>
+  void CodeBuilder::append_format_checked(const char* fmt, TArgs&&... args) {
+  emitIndent();
+  scratch.clear();
+  Format::format(&scratch, fmt, std::forward<TArgs>(args)...);
+  append(scratch.c_str());
+  newline();
 }
 
-template <typename... TArgs>
-  void CodeBuilder::append_format(const char* fmt, TArgs&&... args) {
+template <bool Checked, typename... TArgs>
+  void CodeBuilder::append_line_checked(const char* fmt, TArgs&&... args) {
   emitIndent();
-  boost::format msg(fmt);
-  std::string s = format_string(msg, std::forward<TArgs>(args)...);
-  appendFormat(s.c_str());
+  scratch.clear();
+  Format::format(&scratch, fmt, std::forward<TArgs>(args)...);
+  append(scratch.c_str());
   newline();
 }
 
-template <typename... TArgs>
-  void CodeBuilder::append_line(const char* fmt, TArgs&&... args) {
-    emitIndent();
-    boost::format msg(fmt);
-    std::string s = format_string(msg, std::forward<TArgs>(args)...);
-    appendLine(s.c_str());
-  }
-
 class BSVProgram {
  public:
   BSVProgram() { }
@@ -83,12 +216,26 @@ class CppProgram {
   CodeBuilder simBuilder_;
 };
 
+// resource profile of one table, see DoResourceEstimation
+struct TableProfile {
+  cstring name;
+  cstring type;
+  int size;
+  int key_width;
+  int action_width;
+  // table memory and @shadow, as chosen by TableCodeGen
+  cstring memory;
+  bool shadow;
+};
+
 class Profiler {
  public:
   Profiler() {}
   CodeBuilder& getTableProfiler() { return tableProfiler_; }
+  std::map<cstring, TableProfile>& getTables() { return tables_; }
  private:
   CodeBuilder tableProfiler_;
+  std::map<cstring, TableProfile> tables_;
 };
 
 class Partitioner {
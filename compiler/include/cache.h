@@ -0,0 +1,42 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_CACHE_H_
+#define EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_CACHE_H_
+
+#include "ir/ir.h"
+#include "foptions.h"
+
+namespace FPGA {
+
+// On-disk cache of the mid-end result, stored as P4-16 source. The key is
+// a hash of the preprocessed input, the options that change its meaning,
+// and the build of the compiler, so a stale entry is never picked up.
+class MidEndCache {
+ public:
+  explicit MidEndCache(const FPGAOptions& options);
+  bool lookup() const;
+  void store(const IR::P4Program* program) const;
+  bool remove() const;
+  cstring getPath() const { return path; }
+ private:
+  cstring path;
+};
+
+}  // namespace FPGA
+
+#endif /* EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_CACHE_H_ */
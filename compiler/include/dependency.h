@@ -0,0 +1,85 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_DEPENDENCY_H_
+#define EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_DEPENDENCY_H_
+
+#include "ir/ir.h"
+#include "analyzer.h"
+
+namespace FPGA {
+
+class FPGAControl;
+
+// Field accessed by a table, either as key or from one of its actions.
+// 'path' is the source expression, e.g. hdr.ipv4.ttl, and 'field' the struct
+// field it resolves to, if any.
+struct FieldAccess {
+  cstring path;
+  const IR::StructField* field;
+  bool operator<(const FieldAccess& other) const { return path < other.path; }
+};
+
+// collect fields read and written by an action body
+class FieldAccessCollector : public Inspector {
+ public:
+  std::set<FieldAccess> reads;
+  std::set<FieldAccess> writes;
+  explicit FieldAccessCollector(const FPGAControl* control) :
+    control(control) {}
+  bool preorder(const IR::AssignmentStatement* stmt) override;
+  bool preorder(const IR::Member* member) override;
+  bool preorder(const IR::PathExpression* path) override;
+  bool preorder(const IR::MethodCallExpression* expr) override;
+  FieldAccess toAccess(const IR::Expression* expr) const;
+ private:
+  const FPGAControl* control;
+};
+
+// Read-after-write and write-after-write dependencies between tables.
+// Runs of tables applied back to back with no dependency between them are
+// grouped into one stage, and looked up in parallel.
+class TableDependencyGraph {
+ public:
+  explicit TableDependencyGraph(const FPGAControl* control) :
+    control(control) {}
+  void build();
+  // true if 'later' must wait for the result of 'earlier'
+  bool dependsOn(const IR::P4Table* later, const IR::P4Table* earlier) const;
+  // stage that contains table, nullptr if table is looked up on its own
+  const std::vector<const CFG::TableNode*>* getStage(cstring table) const;
+  const std::set<FieldAccess>& getWrites(const IR::P4Table* table) const
+  { return writes.at(table); }
+  // members of MetadataT written by table, e.g. hdr.ipv4, meta.routing or
+  // standard_metadata.egress_spec, copied back when a stage is joined
+  const std::set<cstring>& getMergeWrites(const IR::P4Table* table) const
+  { return merges.at(table); }
+  std::vector<std::vector<const CFG::TableNode*>> stages;
+ private:
+  const FPGAControl* control;
+  std::map<const IR::P4Table*, std::set<FieldAccess>> reads;
+  std::map<const IR::P4Table*, std::set<FieldAccess>> writes;
+  std::map<const IR::P4Table*, std::set<cstring>> merges;
+  // tables with a write that cannot be copied between MetadataT instances
+  std::set<const IR::P4Table*> unmergeable;
+  cstring mergeUnit(const FieldAccess& access) const;
+  std::map<cstring, size_t> stage_index;
+};
+
+}  // namespace FPGA
+
+#endif /* EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_DEPENDENCY_H_ */
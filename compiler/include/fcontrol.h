@@ -26,6 +26,17 @@
 namespace FPGA {
 
 class FPGAParser;
+class TableDependencyGraph;
+class MetadataLiveness;
+
+// register extern instance, every access site in an action gets its own port
+struct RegisterInfo {
+  cstring name;
+  int size = 0;
+  int width = 0;
+  int banks = 1;
+  int ports = 0;
+};
 
 class FPGAControl { // : public FPGAObject {
  public:
@@ -34,6 +45,8 @@ class FPGAControl { // : public FPGAObject {
     const IR::ControlBlock*       controlBlock;
     FPGAProgram*                  program;
     FPGA::CFG*                    cfg;
+    TableDependencyGraph*         deps = nullptr;
+    MetadataLiveness*             liveness = nullptr;
     CodeBuilder*                  builder;
     CodeBuilder*                  cpp_builder;
     CodeBuilder*                  type_builder;
@@ -51,6 +64,14 @@ class FPGAControl { // : public FPGAObject {
     std::map<const IR::StructField*, std::set<const IR::P4Table*>> metadata_to_table;
     std::map<const IR::StructField*, cstring> metadata_to_action;
     std::map<cstring, const IR::P4Table*> action_to_table;
+    // number of Engine stages of each action
+    std::map<cstring, int> action_stages;
+    // fifo name to the narrow request type it carries
+    std::map<cstring, cstring> fifo_types;
+    // register instances by declared name
+    std::map<cstring, RegisterInfo> registers;
+    // action stage functions and their fifos, emitted inside the module
+    CodeBuilder action_builder;
 
     explicit FPGAControl(FPGAProgram* program,
                          const IR::ControlBlock* block,
@@ -62,16 +83,25 @@ class FPGAControl { // : public FPGAObject {
     cstring toP4Action (cstring inst);
     void emit(BSVProgram & bsv, CppProgram & cpp);
     void emitTableRule(BSVProgram & bsv, const CFG::TableNode* node);
+    void emitStageRule(BSVProgram & bsv, const std::vector<const CFG::TableNode*>& stage);
     void emitCondRule(BSVProgram & bsv, const CFG::IfNode* node);
     void emitEntryRule(BSVProgram & bsv, const CFG::Node* node);
     void emitDeclaration(BSVProgram & bsv);
     void emitConnection(BSVProgram & bsv);
+    void emitEntryInfo(BSVProgram & bsv);
     void emitFifo(BSVProgram & bsv);
+    void emitRegisters(BSVProgram & bsv);
+    void emitLiveTypes(BSVProgram & bsv, cstring cbtype);
+    cstring fifoType(cstring fifo) const;
+    // global table id, ingress tables first, used to address bulk loads
+    int tableId(cstring table) const;
     void emitTables();
     void emitActions(BSVProgram & bsv);
     void emitActionTypes(BSVProgram & bsv);
     void emitAPI(BSVProgram & bsv, cstring cbtype);
     bool build();
+ private:
+    void addRegister(const IR::ExternBlock* block);
 };
 
 }  // namespace FPGA
@@ -29,8 +29,8 @@ class FPGADeparser : public FPGAObject {
   std::vector<IR::BSV::DeparseState*> states;
   CodeBuilder* builder;
 
-  void emitEnums();
-  void emitRules();
+  void emitTypedefs();
+  void emitLayout();
   void emitStates();
 
   explicit FPGADeparser(const FPGAProgram* program, const IR::ControlBlock* block)
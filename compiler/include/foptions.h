@@ -23,8 +23,15 @@
 class FPGAOptions : public CompilerOptions {
  public:
   std::vector<cstring> partitions;
+  bool autoPartition = false;
+  int numPartitions = 2;
   bool dumpTable = false;
+  cstring report = nullptr;
   cstring runtime = nullptr;
+  cstring cacheDir = nullptr;
+  bool timePasses = false;
+  int datapathWidth = 512;
+  int headerVector = 0;
   FPGAOptions() {
     registerOption("-P", "partition1[,partition2]",
                    [this](const char *arg) {
@@ -33,9 +40,63 @@ class FPGAOptions : public CompilerOptions {
                         partitions.push_back(partition);
                       return true;},
                    "Partition control flow at specific table id");
+    registerOption("--partition", "auto",
+                   [this](const char* arg) {
+                      if (strcmp(arg, "auto") != 0) {
+                        ::error("unknown partition mode %1%", arg);
+                        return false;
+                      }
+                      autoPartition = true; return true; },
+                   "Split control flow into balanced partitions using the table profile");
+    registerOption("--pipelines", "n",
+                   [this](const char* arg) {
+                      numPartitions = atoi(arg);
+                      if (numPartitions < 1) {
+                        ::error("invalid number of pipelines %1%", arg);
+                        return false;
+                      }
+                      return true; },
+                   "Number of partitions generated by --partition auto (default 2)");
     registerOption("--profile", nullptr,
                    [this](const char*) { dumpTable = true; return true; },
                    "Dump table resource utilization");
+    registerOption("--report", "json",
+                   [this](const char* arg) {
+                      if (strcmp(arg, "json") != 0) {
+                        ::error("unknown report format %1%", arg);
+                        return false;
+                      }
+                      report = arg; return true; },
+                   "Write resource and latency estimates to report.json");
+    registerOption("--cache", "dir",
+                   [this](const char* arg) {
+                      cacheDir = arg; return true; },
+                   "Reuse the mid-end result of an unchanged program from dir");
+    registerOption("--time-passes", nullptr,
+                   [this](const char*) { timePasses = true; return true; },
+                   "Print the wall time of each compiler phase");
+    registerOption("--datapath-width", "128|256|512",
+                   [this](const char* arg) {
+                      datapathWidth = atoi(arg);
+                      if (datapathWidth != 128 && datapathWidth != 256 && datapathWidth != 512) {
+                        ::error("unsupported datapath width %1%", arg);
+                        return false;
+                      }
+                      return true; },
+                   "Beat width in bits of the generated parser and deparser, 512 for the stream runtime (default 512)");
+    registerOption("--header-vector", "auto|bytes",
+                   [this](const char* arg) {
+                      if (strcmp(arg, "auto") == 0) {
+                        headerVector = -1;
+                        return true;
+                      }
+                      headerVector = atoi(arg);
+                      if (headerVector <= 0) {
+                        ::error("invalid header vector size %1%", arg);
+                        return false;
+                      }
+                      return true; },
+                   "Send only the first bytes of a packet, by default as many as the parser may read, to the pipeline");
     registerOption("-R", "runtime",
                    [this](const char* arg) {
                       runtime = arg; return true; },
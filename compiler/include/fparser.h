@@ -40,6 +40,9 @@ class FPGAParser : public FPGAObject {
   void emitAcceptedHeaders(BSVProgram & bsv, const IR::Type_Struct* headers);
   void emitUserMetadata(BSVProgram & bsv, const IR::Type_Struct* metadata);
   void emitStateElements(BSVProgram & bsv);
+  void mergeStates();
+  void collectVarbits();
+  int maxParseDepth() const;
 
   std::vector<IR::BSV::Rule*>         rules;
 
@@ -63,6 +66,37 @@ class FPGAParser : public FPGAObject {
   std::set<cstring>             pulse_wire_set;
   const IR::ParserState*        initState;
 
+  // Chains of states whose next state is selected by bits of headers
+  // extracted earlier in the chain are merged into one parse step, so that
+  // e.g. ethernet, ipv4 and udp are extracted in the same cycle.
+  // 'mergeHead' maps every state to the first state of its step,
+  // 'mergeWindow' is the number of bits a step buffers before extracting
+  // and 'inlined' holds the transitions, as "from.to", folded into a step.
+  std::map<cstring, cstring>    mergeHead;
+  std::map<cstring, int>        mergeWindow;
+  std::map<cstring, int>        stateWidth;
+  std::set<cstring>             inlined;
+  // A header with a varbit field, extracted by packet.extract(hdr, len).
+  // Its fixed part is extracted like any other header, the varbit field is
+  // then streamed out of the parse buffer, one beat per cycle, by
+  // genVarbitRule of Parser.bsv, so it may span several beats.
+  struct VarbitExtract {
+    cstring header;
+    cstring type;
+    cstring field;
+    int width;  // fixed part
+    const IR::Expression* length;
+  };
+  // keyed by the state extracting the header, such states are never merged
+  std::map<cstring, VarbitExtract> varbits;
+  // headers read by a length expression, kept in rg_hdr_* until needed
+  std::map<cstring, cstring>    lengthHeaders;
+  int                           varbitWidth = 8;
+  // bytes of a packet sent to the parser, 0 for all of it
+  int                           headerVectorBytes = 0;
+  bool isStepHead(cstring state) const;
+  bool isInlined(cstring from, cstring to) const;
+
   explicit FPGAParser(FPGAProgram* program,
                       const IR::ParserBlock* block,
                       const P4::TypeMap* typeMap,
@@ -0,0 +1,57 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_LIVENESS_H_
+#define EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_LIVENESS_H_
+
+#include "ir/ir.h"
+#include "analyzer.h"
+#include "dependency.h"
+
+namespace FPGA {
+
+class FPGAControl;
+
+// Members of the generated Metadata struct live at each node of a control
+// block. A member is live into a node if some path from the node reads it
+// before reaching a table all of whose actions write it. Headers and
+// standard metadata are always carried and not tracked here.
+class MetadataLiveness {
+ public:
+  explicit MetadataLiveness(const FPGAControl* control) :
+    control(control) {}
+  // 'liveAtExit' is what the next control block reads
+  void build(const std::set<cstring>& liveAtExit);
+  const std::set<cstring>& liveIn(const CFG::Node* node) const
+  { return live_in.at(node); }
+  const std::set<cstring>& liveOut(const CFG::Node* node) const
+  { return live_out.at(node); }
+  const std::set<cstring>& liveAtEntry() const;
+ private:
+  const FPGAControl* control;
+  std::set<cstring> members;
+  std::map<const CFG::Node*, std::set<cstring>> uses;
+  std::map<const CFG::Node*, std::set<cstring>> defs;
+  std::map<const CFG::Node*, std::set<cstring>> live_in;
+  std::map<const CFG::Node*, std::set<cstring>> live_out;
+  cstring metaPrefix() const;
+  cstring toMember(const FieldAccess& access) const;
+  void collect(const CFG::Node* node);
+};
+
+}  // namespace FPGA
+
+#endif /* EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_LIVENESS_H_ */
@@ -17,6 +17,8 @@ class MidEnd {
 
     void addDebugHook(DebugHook hook) { hooks.push_back(hook); }
     const IR::P4Program* run(const FPGAOptions& options, const IR::P4Program* program);
+    // program parsed from the mid-end cache only needs name and type information
+    const IR::P4Program* load(const FPGAOptions& options, const IR::P4Program* program);
 };
 
 }  // namespace FPGA
@@ -27,6 +27,42 @@ class DoPartition : public Transform {
     const IR::Node* postorder(IR::MethodCallStatement* statement) override;
 };
 
+// Tables applied in ingress and egress, in the order DoPartition counts them.
+class CollectTableOrder : public Inspector {
+    ReferenceMap* refMap;
+    TypeMap*      typeMap;
+ public:
+    std::vector<cstring> tables;
+    CollectTableOrder(ReferenceMap* refMap, TypeMap* typeMap) :
+            refMap(refMap), typeMap(typeMap)
+    { CHECK_NULL(refMap); CHECK_NULL(typeMap); setName("CollectTableOrder"); }
+    bool preorder(const IR::P4Control* control) override;
+    bool preorder(const IR::MethodCallStatement* statement) override;
+};
+
+// Metadata fields referenced by ingress and egress. These are not carried
+// in the packet and must be serialized when the previous partition runs
+// on another pipeline.
+// Bit fields of metadata and standard metadata referenced by ingress and
+// egress, named from the v1model parameter, e.g. meta.routing.nhop_ipv4 or
+// standard_metadata.egress_spec, with their width.
+class CollectMetadataFields : public Inspector {
+    TypeMap*      typeMap;
+    cstring       metaParam;
+    cstring       standardParam;
+ public:
+    std::map<cstring, int> fields;
+    explicit CollectMetadataFields(TypeMap* typeMap) : typeMap(typeMap)
+    { CHECK_NULL(typeMap); setName("CollectMetadataFields"); }
+    bool preorder(const IR::P4Control* control) override;
+    bool preorder(const IR::Member* member) override;
+};
+
+// Split tables, in apply order, into n contiguous partitions minimizing the
+// cost of the largest one. Returns the number of tables up to and including
+// each partition, which is the 'tend' of DoPartition.
+std::vector<int> balancePartitions(const std::vector<int>& cost, int n);
+
 class Partition : public PassManager {
  public:
   Partition(ReferenceMap* refMap, TypeMap* typeMap, int tbegin, int tend) {
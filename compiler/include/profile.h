@@ -12,8 +12,10 @@ namespace P4 {
 class DoResourceEstimation : public Inspector {
   // temporary variables to pass values
   cstring table_name;
-  cstring table_type;
-  int width_bit;
+  cstring table_type = "exact";
+  int width_bit = 0;
+  int key_width = 0;
+  int action_width = 0;
   int table_size;
   FPGA::Profiler*     profgen;
   const ReferenceMap* refMap;
@@ -58,6 +58,14 @@ class FPGAProgram : public FPGAObject {
   FPGADeparser*             deparser;
   // TODO: flexible pipeline should have a map of these controlblocks
   std::map<cstring, const IR::Member*> metadata;
+  // beat width of the generated parser and deparser, in bits
+  int datapathWidth = 512;
+  // header vector mode: bytes of a packet that enter the pipeline, -1 to
+  // size it from the parse graph, 0 to send the whole packet
+  int headerVector = 0;
+
+  // members of the generated Metadata struct, name and type, in order
+  std::vector<std::pair<cstring, cstring>> metadataMembers() const;
 
   // write program as bluespec source code
   void emit(BSVProgram & bsv, CppProgram & cpp); // override;
@@ -80,6 +88,7 @@ class FPGAProgram : public FPGAObject {
   void emitHeaderInstances(CodeBuilder* builder);
   void emitPipeline(CodeBuilder* builder);
   void emitHeaders(CodeBuilder* builder);
+  void emitTableIds(CodeBuilder* builder);
   void emitMetadata(CodeBuilder* builder);
   void emitBuiltinMetadata(CodeBuilder* builder);
   void emitLicense(CodeBuilder* builder);
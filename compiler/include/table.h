@@ -125,12 +125,48 @@ class ActionParamPrinter : public Inspector {
   cstring table_name;
 };
 
+// number of entries assumed for tables without a 'size' property
+static const int kDefaultTableSize = 256;
+
+// source of the exact, lpm and ternary simulation models, see table_model.cpp
+extern const char* kMatchTableModel;
+
+// hardware size of a table, see TableCodeGen::getTableSizing
+struct TableSizing {
+  int size;
+  int key_width;
+  int depth;
+  int bram;
+};
+
 // per table code generator
 class TableCodeGen : public Inspector {
  public:
   TableCodeGen(FPGAControl* control, CodeBuilder* builder, CodeBuilder* cpp_builder, CodeBuilder* type_builder) :
     control(control), builder(builder), cpp_builder(cpp_builder), type_builder(type_builder) {}
   bool preorder(const IR::P4Table* table) override;
+  static int getTableSize(const IR::P4Table* table);
+  static cstring getMatchType(const IR::P4Table* table);
+  static int getTableDepth(cstring match_type, int size, int key_width);
+  static int getBramCost(cstring match_type, int depth, int key_width, int value_width);
+  // key width padded to the 9-bit slices of the tcam
+  static int getKeyWidth(int key_width);
+  // bits of the RspT struct: the action id and one field per distinct
+  // parameter name, actions that share a name share the field
+  static int getActionWidth(int actions, const std::map<cstring, const IR::Type_Bits*>& params);
+  // size, depth and BRAM36 of a table held in 'memory', the one sizing
+  // model used by the code generator, the report and the partitioner
+  static TableSizing getTableSizing(cstring memory, bool shadow, int size,
+                                    int key_width, int value_width);
+  static void emitCppModel(CodeBuilder* cpp_builder);
+  // @shadow tables keep a second copy for atomic bulk loads
+  static bool isShadow(const IR::P4Table* table);
+  // exact @cuckoo tables use the cuckoo hash instead of DMHC
+  static bool isCuckoo(const IR::P4Table* table);
+  // entries have an index the control plane can delete, modify and read,
+  // a DMHC table only answers read_entry, with valid False
+  static bool isIndexed(const IR::P4Table* table);
+  static cstring getTableMemory(const IR::P4Table* table, cstring match_type);
   // bool preorder(const IR::MethodCallExpression* expr) override;
  private:
   FPGAControl* control;
@@ -140,6 +176,10 @@ class TableCodeGen : public Inspector {
   int key_width = 0;
   int action_size = 0;
   int action_idx = 0;
+  int table_size = 0;
+  int table_depth = 0;
+  int lpm_width = 0;
+  cstring match_type = "exact";
   std::vector<std::pair<const IR::StructField*, int>> key_vec;
   std::vector<cstring> action_vec;
   cstring defaultActionName;
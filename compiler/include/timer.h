@@ -0,0 +1,42 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifndef EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_TIMER_H_
+#define EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_TIMER_H_
+
+#include <chrono>
+#include <ostream>
+#include "lib/cstring.h"
+
+namespace FPGA {
+
+// Wall time of a compiler phase, accumulated over all scopes with the same
+// name and printed by --time-passes.
+class PassTimer {
+ public:
+  explicit PassTimer(cstring name);
+  ~PassTimer();
+  static void report(std::ostream& out);
+  static bool enabled;
+ private:
+  cstring name;
+  std::chrono::steady_clock::time_point start;
+};
+
+}  // namespace FPGA
+
+#endif /* EXTENSIONS_CPP_LIBP4FPGA_INCLUDE_TIMER_H_ */
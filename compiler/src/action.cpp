@@ -14,219 +14,776 @@
   See the License for the specific language governing permissions and
   limitations under the License.
 */
+#include <algorithm>
+#include <cstring>
+#include <sstream>
 #include "ir/ir.h"
 #include "action.h"
+#include "dependency.h"
 #include "frontends/p4/methodInstance.h"
 #include "string_utils.h"
 
 namespace FPGA {
 
-bool ActionCodeGen::preorder(const IR::AssignmentStatement* stmt) {
-  auto type = control->program->typeMap->getType(stmt->left, true);
-  if (type != nullptr) {
-    if (type->is<IR::Type_Bits>()) {
-      auto bits = type->to<IR::Type_Bits>();
-      builder->append_line("// INST (%d) %s = %s", bits->width_bits(), stmt->left, stmt->right);
-    } else {
-      builder->append_line("// INST (%d) %s = %s", stmt->left, stmt->right);
+// add and sub up to this width fit in fabric next to another operation,
+// wider ones and multiplies go to a DSP slice and are not chained
+static const int kChainWidth = 16;
+
+static const IR::Parameter* controlParam(const FPGAControl* control, int index) {
+  return control->controlBlock->container->type->applyParams->getParameter(index);
+}
+
+// hdr.ipv4 overlaps hdr.ipv4.ttl, but not hdr.ipv4_opt
+static bool overlaps(cstring a, cstring b) {
+  auto n = std::min(a.size(), b.size());
+  if (strncmp(a.c_str(), b.c_str(), n) != 0) return false;
+  if (a.size() == b.size()) return true;
+  return (a.size() > n ? a.c_str()[n] : b.c_str()[n]) == '.';
+}
+
+static cstring bsvType(const IR::Type* type) {
+  if (type->is<IR::Type_Boolean>()) return "Bool";
+  auto bits = type->to<IR::Type_Bits>();
+  if (bits == nullptr) return nullptr;
+  return cstring(bits->isSigned ? "Int#(" : "Bit#(") + std::to_string(bits->size) + ")";
+}
+
+// names of the registers called in a subtree
+class RegisterUses : public Inspector {
+ public:
+  explicit RegisterUses(const FPGAControl* control) : control(control) {}
+  std::set<cstring> names;
+  bool preorder(const IR::MethodCallExpression* expr) override {
+    auto mi = P4::MethodInstance::resolve(expr,
+                                          control->program->refMap,
+                                          control->program->typeMap);
+    auto em = mi->to<P4::ExternMethod>();
+    if (em != nullptr && em->originalExternType->name == control->program->v1model.registers.name) {
+      names.insert(em->object->getName().name);
     }
+    return true;
   }
-  visit(stmt->left);
-  visit(stmt->right);
-  return false;
+ private:
+  const FPGAControl* control;
+};
+
+static bool touches(const FPGAControl* control, const IR::Node* node, cstring reg) {
+  RegisterUses uses(control);
+  node->apply(uses);
+  return uses.names.count(reg) != 0;
 }
 
-bool ActionCodeGen::preorder(const IR::Expression* expression) {
-  // accessing part of metadata struct, thus member type
-  if (expression->is<IR::Member>()) {
-    auto m = expression->to<IR::Member>();
-    auto type = control->program->typeMap->getType(m->expr, true);
-    if (type->is<IR::Type_Struct>()) {
-      auto t = type->to<IR::Type_StructLike>();
-      auto f = t->getField(m->member);
+static bool dependsOn(const std::set<FieldAccess>& reads, const std::set<FieldAccess>& writes) {
+  for (auto r : reads) {
+    for (auto w : writes) {
+      if (overlaps(r.path, w.path)) return true;
     }
   }
   return false;
 }
 
-bool ActionCodeGen::preorder(const IR::MethodCallExpression* expression) {
-  auto mi = P4::MethodInstance::resolve(expression,
-                                        control->program->refMap,
-                                        control->program->typeMap);
-  auto apply = mi->to<P4::ApplyMethod>();
-  if (apply != nullptr) {
-    LOG1("handle apply");
-    return false;
+// Lowers an expression of an action body to bluespec. Headers and metadata
+// structs are read from locals loaded at the start of the stage.
+class ActionExprCodeGen : public Inspector {
+ public:
+  ActionExprCodeGen(ActionCodeGen* action, ActionStmt* stmt) :
+    action(action), stmt(stmt) {}
+  cstring bsv = "";
+  bool preorder(const IR::Constant* cst) override;
+  bool preorder(const IR::BoolLiteral* b) override;
+  bool preorder(const IR::Member* m) override;
+  bool preorder(const IR::PathExpression* path) override;
+  bool preorder(const IR::Slice* slice) override;
+  bool preorder(const IR::Concat* expr) override;
+  bool preorder(const IR::Operation_Binary* expr) override;
+  bool preorder(const IR::Cast* cast) override;
+  bool preorder(const IR::Operation_Unary* expr) override;
+  bool preorder(const IR::Mux* mux) override;
+  bool preorder(const IR::MethodCallExpression* expr) override;
+  bool preorder(const IR::Expression* expr) override;
+ private:
+  ActionCodeGen* action;
+  ActionStmt* stmt;
+  const IR::Type* typeOf(const IR::Expression* expr) const
+  { return action->control->program->typeMap->getType(expr, true); }
+};
+
+bool ActionExprCodeGen::preorder(const IR::Constant* cst) {
+  if (cst->fitsInt()) {
+    bsv += std::to_string(cst->asInt());
+  } else {
+    std::stringstream ss;
+    ss << "'h" << std::hex << cst->value;
+    bsv += ss.str();
   }
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::BoolLiteral* b) {
+  bsv += b->value ? "True" : "False";
+  return false;
+}
 
-  auto ext = mi->to<P4::ExternMethod>();
-  if (ext != nullptr) {
-    LOG1("MethodCall extern type");
-    // ext->type : register
-    // ext->expr : register name
-    builder->append_line("// INST extern %s %s", ext->method->name.toString(), ext->expr->toString());
+bool ActionExprCodeGen::preorder(const IR::Member* m) {
+  bsv += action->location(m, stmt, false);
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::PathExpression* path) {
+  bsv += action->location(path, stmt, false);
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::Slice* slice) {
+  bsv += "(";
+  visit(slice->e0);
+  bsv += cstring(")[") + std::to_string(slice->getH()) + ":" + std::to_string(slice->getL()) + "]";
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::Concat* expr) {
+  bsv += "{";
+  visit(expr->left);
+  bsv += ", ";
+  visit(expr->right);
+  bsv += "}";
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::Operation_Binary* expr) {
+  if (expr->is<IR::Div>() || expr->is<IR::Mod>()) {
+    ::error("%1%: division is not supported in actions", expr);
     return false;
   }
+  if (expr->is<IR::Mul>()) {
+    stmt->dsp = true;
+  } else if (expr->is<IR::Add>() || expr->is<IR::Sub>()) {
+    stmt->dsp |= typeOf(expr)->width_bits() > kChainWidth;
+  }
+  bsv += "(";
+  visit(expr->left);
+  bsv += cstring(" ") + expr->getStringOp() + " ";
+  visit(expr->right);
+  bsv += ")";
+  return false;
+}
 
-  auto actioncall = mi->to<P4::ActionCall>();
-  if (actioncall != nullptr) {
-    LOG1("action call");
-    builder->append_line(expression->toString());
+bool ActionExprCodeGen::preorder(const IR::Cast* cast) {
+  if (cast->expr->is<IR::Constant>()) {
+    visit(cast->expr);
     return false;
   }
+  auto to = typeOf(cast);
+  auto from = typeOf(cast->expr);
+  if (to->is<IR::Type_Boolean>()) {
+    bsv += "(";
+    visit(cast->expr);
+    bsv += " == 1)";
+    return false;
+  }
+  if (from->is<IR::Type_Boolean>()) {
+    bsv += "pack(";
+    visit(cast->expr);
+    bsv += ")";
+    return false;
+  }
+  int tw = to->width_bits();
+  int fw = from->width_bits();
+  cstring fn = "";
+  if (tw > fw) {
+    fn = from->to<IR::Type_Bits>()->isSigned ? "signExtend" : "zeroExtend";
+  } else if (tw < fw) {
+    fn = "truncate";
+  }
+  bsv += fn + "(";
+  visit(cast->expr);
+  bsv += ")";
+  return false;
+}
 
-  auto extFunc = mi->to<P4::ExternFunction>();
-  if (extFunc != nullptr) {
-    if (extFunc->method->name == "mark_to_drop") {
-      builder->append_line("// mark_to_drop ");
-    } else {
-      builder->append_line("// INST extern %s", extFunc->method->name.toString());
-    }
+bool ActionExprCodeGen::preorder(const IR::Operation_Unary* expr) {
+  bsv += expr->getStringOp() + "(";
+  visit(expr->expr);
+  bsv += ")";
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::Mux* mux) {
+  bsv += "(";
+  visit(mux->e0);
+  bsv += " ? ";
+  visit(mux->e1);
+  bsv += " : ";
+  visit(mux->e2);
+  bsv += ")";
+  return false;
+}
+
+bool ActionExprCodeGen::preorder(const IR::MethodCallExpression* expr) {
+  auto mi = P4::MethodInstance::resolve(expr,
+                                        action->control->program->refMap,
+                                        action->control->program->typeMap);
+  auto bim = mi->to<P4::BuiltInMethod>();
+  if (bim != nullptr && bim->name == IR::Type_Header::isValid &&
+      bim->appliedTo->is<IR::Member>()) {
+    action->location(bim->appliedTo, stmt, false);
+    bsv += cstring("valid_") + bim->appliedTo->to<IR::Member>()->member.toString();
     return false;
   }
+  ::error("%1%: unsupported call in action expression", expr);
+  return false;
+}
 
+bool ActionExprCodeGen::preorder(const IR::Expression* expr) {
+  ::error("%1%: unsupported expression in action", expr);
   return false;
 }
 
-void ActionCodeGen::emitCpuRspRule(const IR::P4Action* action) {
-  auto name = action->name;
-  auto type = CamelCase(name);
-  auto table = control->action_to_table[name];
-  auto table_name = nameFromAnnotation(table->annotations, table->name);
-  auto table_type = CamelCase(table_name);
-  std::vector<cstring> fields;
-  if (action->parameters->size() > 0) {
-    auto params = action->parameters->to<IR::ParameterList>();
-    if (params != nullptr) {
-      for (auto p : params->parameters) {
-        fields.push_back(p->name);
-      }
+cstring ActionCodeGen::headerLocal(const IR::Member* hdr, ActionStmt* stmt) {
+  auto type = control->program->typeMap->getType(hdr, true);
+  if (!type->is<IR::Type_Header>()) {
+    ::error("%1%: header stacks and unions are not supported in actions", hdr);
+    return nullptr;
+  }
+  cstring h = hdr->member.toString();
+  cstring local = cstring("hdr_") + h;
+  if (locals.count(local) == 0) {
+    ActionLocal l;
+    cstring type_name = CamelCase(type->to<IR::Type_Header>()->name.toString());
+    l.load.push_back(cstring("Header#(") + type_name + ") " + local +
+                     " = fromMaybe(defaultValue, rsp.meta.hdr." + h + ");");
+    l.load.push_back(cstring("Bool valid_") + h + " = isValid(rsp.meta.hdr." + h + ");");
+    l.store = cstring("rsp.meta.hdr.") + h + " = valid_" + h +
+              " ? tagged Valid " + local + " : tagged Invalid;";
+    locals[local] = l;
+  }
+  stmt->locals.insert(local);
+  return local;
+}
+
+cstring ActionCodeGen::param(const IR::PathExpression* path, ActionStmt* stmt) {
+  stmt->reads.insert(path->toString());
+  return cstring("pack(p.") + path->path->name.toString() + ")";
+}
+
+// hdr.ipv4.ttl is hdr_ipv4.hdr.ttl, meta.routing_metadata.nhop_ipv4 is
+// meta_routing_metadata.nhop_ipv4 and standard metadata is accessed in place
+cstring ActionCodeGen::location(const IR::Expression* expr, ActionStmt* stmt, bool write) {
+  auto& access = write ? stmt->writes : stmt->reads;
+  if (expr->is<IR::PathExpression>()) {
+    auto path = expr->to<IR::PathExpression>();
+    auto decl = control->program->refMap->getDeclaration(path->path, true);
+    if (decl->is<IR::Declaration_Variable>()) {
+      access.insert(path->toString());
+      return path->path->name.toString();
+    }
+    if (!write && decl->is<IR::Parameter>()) {
+      return param(path, stmt);
     }
-    LOG1("// Action Response: need to update metadata");
+    ::error("%1%: unsupported location in action", expr);
+    return "?";
   }
-  builder->append_line("rule rl_cpu_resp if (cpu.not_running());");
-  builder->incr_indent();
-  builder->append_line("let pkt <- toGet(curr_packet_ff).get;"); // FIXME: bottleneck
-  builder->append_format("%sActionRsp rsp = tagged %sRspT { pkt: pkt, meta: metadata};", table_type, type);
-  builder->append_line("tx_info_prev_control_state.enq(rsp);");
-  builder->decr_indent();
-  builder->append_line("endrule");
+
+  // hdr.ipv4.ttl : the member below the control parameter, and the rest
+  std::vector<cstring> names;
+  const IR::Member* top = nullptr;
+  const IR::Expression* e = expr;
+  while (e->is<IR::Member>()) {
+    top = e->to<IR::Member>();
+    names.insert(names.begin(), top->member.toString());
+    e = top->expr;
+  }
+  if (top == nullptr || !e->is<IR::PathExpression>()) {
+    ::error("%1%: unsupported location in action", expr);
+    return "?";
+  }
+  access.insert(expr->toString());
+  cstring rest = "";
+  for (size_t i = 1; i < names.size(); i++) {
+    rest += cstring(".") + names[i];
+  }
+
+  auto& model = control->program->v1model.ingress;
+  cstring base = e->to<IR::PathExpression>()->path->name.toString();
+  if (base == controlParam(control, model.standardMetadataParam.index)->name) {
+    if (names.size() != 1) {
+      ::error("%1%: unsupported location in action", expr);
+      return "?";
+    }
+    cstring field = cstring("rsp.meta.standard_metadata.") + names[0];
+    return write ? field : cstring("fromMaybe(0, ") + field + ")";
+  }
+  if (base == controlParam(control, model.headersParam.index)->name) {
+    cstring local = headerLocal(top, stmt);
+    if (local == nullptr) return "?";
+    if (write) stmt->stores.insert(local);
+    return local + ".hdr" + rest;
+  }
+  if (base == controlParam(control, model.metadataParam.index)->name) {
+    auto type = control->program->typeMap->getType(top, true);
+    if (!type->is<IR::Type_Struct>()) {
+      ::error("%1%: only struct members of metadata are carried between tables", expr);
+      return "?";
+    }
+    cstring local = cstring("meta_") + names[0];
+    if (locals.count(local) == 0) {
+      ActionLocal l;
+      l.load.push_back(CamelCase(type->to<IR::Type_Struct>()->name.toString()) + " " + local +
+                       " = fromMaybe(defaultValue, rsp.meta.meta." + names[0] + ");");
+      l.store = cstring("rsp.meta.meta.") + names[0] + " = tagged Valid " + local + ";";
+      locals[local] = l;
+    }
+    stmt->locals.insert(local);
+    if (write) stmt->stores.insert(local);
+    return local + rest;
+  }
+  ::error("%1%: unsupported location in action", expr);
+  return "?";
 }
 
-void ActionCodeGen::emitActionBegin(const IR::P4Action* action) {
-  cstring name = nameFromAnnotation(action->annotations, action->name);
-  cstring orig_name = action->name.toString();
-  cstring type = CamelCase(name);
-  LOG1("action name " << name << " " << orig_name);
-  const IR::P4Table* table = control->action_to_table[name];
-  if (table == nullptr) {
-    ::error("unable to find table from action %s", name);
+void ActionCodeGen::assign(const IR::Expression* left, cstring value, ActionStmt* s) {
+  cstring range = "";
+  if (left->is<IR::Slice>()) {
+    auto slice = left->to<IR::Slice>();
+    range = cstring("[") + std::to_string(slice->getH()) + ":" + std::to_string(slice->getL()) + "]";
+    left = slice->e0;
+    // the bits outside the slice are kept
+    s->reads.insert(left->toString());
+  }
+  cstring lv = location(left, s, true);
+  if (lv.startsWith("rsp.meta.standard_metadata.")) {
+    if (range != "") {
+      ::error("%1%: partial write of standard metadata", left);
+    }
+    s->lines.push_back(lv + " = tagged Valid " + value + ";");
+  } else {
+    s->lines.push_back(lv + range + " = " + value + ";");
+  }
+
+  // tables match on the copy of the field kept in Metadata
+  if (left->is<IR::Member>()) {
+    auto m = left->to<IR::Member>();
+    auto type = control->program->typeMap->getType(m->expr, true);
+    if (type->is<IR::Type_StructLike>()) {
+      auto f = type->to<IR::Type_StructLike>()->getField(m->member);
+      if (f != nullptr && (control->program->ingress->metadata_to_table.count(f) != 0 ||
+                           control->program->egress->metadata_to_table.count(f) != 0)) {
+        auto name = nameFromAnnotation(f->annotations, f->name);
+        if (lv.startsWith("rsp.meta.standard_metadata.")) {
+          s->lines.push_back(cstring("rsp.meta.meta.") + name + " = " + lv + ";");
+        } else {
+          s->lines.push_back(cstring("rsp.meta.meta.") + name + " = tagged Valid " + lv + ";");
+        }
+      }
+    }
   }
-  table_name = nameFromAnnotation(table->annotations, table->name);
-  table_type = CamelCase(table_name);
 }
 
-void ActionCodeGen::emitDropAction(const IR::P4Action* action) {
-  cstring name = nameFromAnnotation(action->annotations, action->name);
-  cstring type = CamelCase(name);
-  const IR::P4Table* table = control->action_to_table[name];
-  if (table == nullptr) {
-    ::error("unable to find table from action %s", name);
+bool ActionCodeGen::preorder(const IR::AssignmentStatement* stmt) {
+  ActionStmt s;
+  ActionExprCodeGen rhs(this, &s);
+  stmt->right->apply(rhs);
+  assign(stmt->left, rhs.bsv, &s);
+  stmts.push_back(s);
+  return false;
+}
+
+// register method called by a statement, nullptr for anything else
+const P4::ExternMethod* ActionCodeGen::registerCall(const IR::StatOrDecl* stmt) const {
+  auto call = stmt->to<IR::MethodCallStatement>();
+  if (call == nullptr) return nullptr;
+  auto mi = P4::MethodInstance::resolve(call->methodCall,
+                                        control->program->refMap,
+                                        control->program->typeMap);
+  auto em = mi->to<P4::ExternMethod>();
+  if (em == nullptr || em->originalExternType->name != control->program->v1model.registers.name) {
+    return nullptr;
   }
-  cstring table_name = nameFromAnnotation(table->annotations, table->name);
-  cstring table_type = CamelCase(table_name);
+  return em;
+}
 
-  builder->append_line("typedef Engine#(1, MetadataRequest, %sParam) %sAction;", table_type, type);
+// The request is sent from the current stage. If the op returns a value,
+// 'out' is assigned from the response at the start of the next stage.
+void ActionCodeGen::registerAccess(cstring reg, cstring op, const IR::Expression* index,
+                                   const IR::Expression* data, const IR::Expression* cmp,
+                                   const IR::Expression* out) {
+  auto it = control->registers.find(reg);
+  if (it == control->registers.end()) {
+    ::error("%1%: register %2% is not declared in this control", index, reg);
+    return;
+  }
+  auto& info = it->second;
+  cstring port = std::to_string(info.ports++);
+  cstring inst = cstring("reg_") + info.name;
+  ActionStmt s;
+  auto lower = [&](const IR::Expression* e) {
+    if (e == nullptr) return cstring("?");
+    ActionExprCodeGen expr(this, &s);
+    e->apply(expr);
+    return expr.bsv;
+  };
+  cstring addr = lower(index);
+  cstring value = lower(data);
+  cstring compare = lower(cmp);
+  s.lines.push_back(inst + "_req_ff[" + port + "].enq(RegRMWRequest {addr: truncate(Bit#(32)'(" +
+                    addr + ")), op: " + op + ", data: " + value + ", cmp: " + compare + "});");
+  stmts.push_back(s);
+  if (out == nullptr) return;
+  ActionStmt r;
+  r.starts_stage = true;
+  r.lines.push_back(cstring("let ") + inst + "_rsp_" + port + " <- toGet(" + inst + "_rsp_ff[" + port + "]).get;");
+  assign(out, inst + "_rsp_" + port + ".data", &r);
+  stmts.push_back(r);
 }
 
-void ActionCodeGen::emitNoAction(const IR::P4Action* action) {
-  cstring name = nameFromAnnotation(action->annotations, action->name);
-  cstring type = CamelCase(name);
-  const IR::P4Table* table = control->action_to_table[name];
-  if (table == nullptr) {
-    ::error("unable to find table from action %s", name);
+// r.read(x, i) followed by r.write(i, x + y), or by x = x + y; r.write(i, x),
+// is one RegAdd of y, and likewise for max written as a mux. A write guarded
+// by if (x == c) is a RegCas. y and c must be known when the read is issued.
+// The statements in between are lowered as usual and see x as read.
+bool ActionCodeGen::fuseRegister(const IR::IndexedVector<IR::StatOrDecl>& c, size_t i, size_t* end) {
+  auto& model = control->program->v1model.registers;
+  auto read = registerCall(c.at(i));
+  if (read == nullptr || read->method->name != model.read.name) return false;
+  cstring reg = read->object->getName().name;
+  auto x = read->expr->arguments->at(0);
+  auto index = read->expr->arguments->at(1);
+  cstring X = x->toString();
+  size_t j = i + 1;
+  while (j < c.size() && !touches(control, c.at(j), reg)) j++;
+  if (j == c.size()) return false;
+
+  const P4::ExternMethod* write = registerCall(c.at(j));
+  const IR::Expression* cmp = nullptr;
+  if (write == nullptr && c.at(j)->is<IR::IfStatement>()) {
+    auto ifs = c.at(j)->to<IR::IfStatement>();
+    const IR::StatOrDecl* body = ifs->ifTrue;
+    if (body->is<IR::BlockStatement>() && body->to<IR::BlockStatement>()->components.size() == 1) {
+      body = body->to<IR::BlockStatement>()->components.at(0);
+    }
+    auto eq = ifs->condition->to<IR::Equ>();
+    if (ifs->ifFalse != nullptr || eq == nullptr || touches(control, ifs->condition, reg)) return false;
+    if (eq->left->toString() == X) {
+      cmp = eq->right;
+    } else if (eq->right->toString() == X) {
+      cmp = eq->left;
+    } else {
+      return false;
+    }
+    write = registerCall(body);
+  }
+  if (write == nullptr || write->method->name != model.write.name) return false;
+  if (write->expr->arguments->at(0)->toString() != index->toString()) return false;
+  auto value = write->expr->arguments->at(1);
+
+  // at most one update of x in between, which is then the value written
+  size_t value_at = j;
+  for (size_t k = i + 1; k < j; k++) {
+    auto a = c.at(k)->to<IR::AssignmentStatement>();
+    if (a == nullptr || a->left->toString() != X) continue;
+    if (cmp != nullptr || value_at != j || value->toString() != X) return false;
+    value = a->right;
+    value_at = k;
+  }
+  FieldAccessCollector before(control);
+  FieldAccessCollector between(control);
+  for (size_t k = i + 1; k < j; k++) {
+    if (k < value_at) c.at(k)->apply(before);
+    if (k != value_at) c.at(k)->apply(between);
   }
-  cstring table_name = nameFromAnnotation(table->annotations, table->name);
-  cstring table_type = CamelCase(table_name);
+  std::set<FieldAccess> x_access = {{X, nullptr}};
+  if (dependsOn(x_access, between.writes)) return false;
+  FieldAccessCollector index_reads(control);
+  index->apply(index_reads);
+  if (dependsOn(index_reads.reads, between.writes)) return false;
 
-  builder->append_line("typedef Engine#(1, MetadataRequest, %sParam) %sAction;", table_type, type);
+  cstring op = nullptr;
+  const IR::Expression* data = nullptr;
+  auto other = [&](const IR::Expression* a, const IR::Expression* b) -> const IR::Expression* {
+    if (a->toString() == X) return b;
+    if (b->toString() == X) return a;
+    return nullptr;
+  };
+  if (cmp != nullptr) {
+    op = "RegCas";
+    data = value;
+  } else if (value->is<IR::Add>()) {
+    op = "RegAdd";
+    data = other(value->to<IR::Add>()->left, value->to<IR::Add>()->right);
+  } else if (value->is<IR::Mux>()) {
+    // a > b ? a : b, a < b ? b : a and the same with >= and <=
+    auto mux = value->to<IR::Mux>();
+    auto rel = mux->e0->to<IR::Operation_Relation>();
+    if (rel != nullptr) {
+      bool greater = rel->is<IR::Grt>() || rel->is<IR::Geq>();
+      bool less = rel->is<IR::Lss>() || rel->is<IR::Leq>();
+      auto hi = greater ? rel->left : rel->right;
+      auto lo = greater ? rel->right : rel->left;
+      if ((greater || less) && mux->e1->toString() == hi->toString() &&
+          mux->e2->toString() == lo->toString()) {
+        op = "RegMax";
+        data = other(hi, lo);
+      }
+    }
+  }
+  if (op == nullptr || data == nullptr) return false;
+  for (auto e : {data, cmp}) {
+    if (e == nullptr) continue;
+    FieldAccessCollector operand(control);
+    e->apply(operand);
+    if (dependsOn(operand.reads, x_access) || dependsOn(operand.reads, before.writes)) return false;
+  }
+
+  registerAccess(reg, op, index, data, cmp, x);
+  for (size_t k = i + 1; k < j; k++) {
+    visit(c.at(k));
+  }
+  *end = j;
+  LOG1("register " << reg << ": read and write fused into " << op);
+  return true;
 }
 
-void ActionCodeGen::emitModifyAction(const IR::P4Action* action) {
-  cstring name = nameFromAnnotation(action->annotations, action->name);
-  cstring type = CamelCase(name);
-  const IR::P4Table* table = control->action_to_table[name];
-  if (table == nullptr) {
-    ::error("unable to find table from action %s", name);
+bool ActionCodeGen::preorder(const IR::MethodCallStatement* stmt) {
+  auto mi = P4::MethodInstance::resolve(stmt->methodCall,
+                                        control->program->refMap,
+                                        control->program->typeMap);
+  ActionStmt s;
+  auto bim = mi->to<P4::BuiltInMethod>();
+  auto extFunc = mi->to<P4::ExternFunction>();
+  auto reg = registerCall(stmt);
+  if (reg != nullptr) {
+    cstring name = reg->object->getName().name;
+    auto args = stmt->methodCall->arguments;
+    if (reg->method->name == control->program->v1model.registers.read.name) {
+      reg_reads.insert(name);
+      registerAccess(name, "RegRead", args->at(1), nullptr, nullptr, args->at(0));
+    } else {
+      reg_writes.insert(name);
+      registerAccess(name, "RegWrite", args->at(0), args->at(1), nullptr, nullptr);
+    }
+    return false;
+  } else if (bim != nullptr && bim->appliedTo->is<IR::Member>() &&
+      (bim->name == IR::Type_Header::setValid || bim->name == IR::Type_Header::setInvalid)) {
+    location(bim->appliedTo, &s, true);
+    cstring h = bim->appliedTo->to<IR::Member>()->member.toString();
+    bool valid = bim->name == IR::Type_Header::setValid;
+    s.lines.push_back(cstring("valid_") + h + " = " + (valid ? "True" : "False") + ";");
+  } else if (extFunc != nullptr && extFunc->method->name == "mark_to_drop") {
+    // port 0 is tied off in the runtime
+    s.writes.insert("standard_metadata.egress_port");
+    s.lines.push_back("rsp.meta.standard_metadata.egress_port = tagged Valid 0;");
+  } else if (mi->is<P4::ExternMethod>() || extFunc != nullptr) {
+    // dropping the call would change what the action does
+    ::error("%1%: only register and mark_to_drop externs are supported in actions", stmt);
+    return false;
+  } else {
+    ::error("%1%: unsupported call in action", stmt);
+    return false;
   }
-  cstring table_name = nameFromAnnotation(table->annotations, table->name);
-  cstring table_type = CamelCase(table_name);
-  builder->append_line("typedef Engine#(1, MetadataRequest, %sParam) %sAction;", table_type, type);
-  builder->append_line("instance Action_execute #(%sParam);", table_type);
-  // FIXME: do one step for now..
-  builder->incr_indent();
-  builder->append_line("function ActionValue#(MetadataRequest) step_1 (MetadataRequest meta, %sParam param);", table_type);
-  builder->incr_indent();
-  builder->append_line("actionvalue");
-  builder->incr_indent();
-  builder->append_line("$display(\"(%%0d) step 1: \", $time, fshow(meta));");
-  // table->params
-  // invoke each action
-  builder->append_line("return meta;");
-  builder->decr_indent();
-  builder->append_line("endactionvalue");
-  builder->decr_indent();
-  builder->append_line("endfunction");
-  builder->decr_indent();
-  builder->append_line("endinstance");
-}
-
-bool ActionCodeGen::isDropAction(const IR::P4Action* action) {
-  bool is_drop = false;
-  if (action->body == nullptr) {
+  stmts.push_back(s);
+  return false;
+}
+
+// declared at the start of every stage, the initializer is an assignment
+bool ActionCodeGen::preorder(const IR::Declaration_Variable* decl) {
+  auto type = bsvType(control->program->typeMap->getType(decl, true));
+  if (type == nullptr) {
+    ::error("%1%: unsupported variable type in action", decl);
     return false;
   }
-  for (auto s : action->body->components) {
-    auto stmt = s->to<IR::MethodCallStatement>();
-    if (stmt == nullptr) continue;
-    auto expr = stmt->methodCall->to<IR::MethodCallExpression>();
-    if (expr == nullptr) continue;
+  variables[decl->name.toString()] = type;
+  if (decl->initializer == nullptr) return false;
+  ActionStmt s;
+  ActionExprCodeGen expr(this, &s);
+  decl->initializer->apply(expr);
+  s.writes.insert(decl->name.toString());
+  s.lines.push_back(decl->name.toString() + " = " + expr.bsv + ";");
+  stmts.push_back(s);
+  return false;
+}
+
+bool ActionCodeGen::preorder(const IR::BlockStatement* block) {
+  auto& c = block->components;
+  for (size_t i = 0; i < c.size(); i++) {
+    size_t end = i;
+    if (fuseRegister(c, i, &end)) {
+      i = end;
+    } else {
+      visit(c.at(i));
+    }
+  }
+  return false;
+}
 
-    if (expr->method->is<IR::PathExpression>()) {
-      auto path = expr->method->to<IR::PathExpression>();
-      if (path != nullptr && path->path->name == "mark_to_drop") {
-        return true;
+// both branches become one statement, so an if is never split across stages
+bool ActionCodeGen::preorder(const IR::IfStatement* stmt) {
+  ActionStmt s;
+  ActionExprCodeGen cond(this, &s);
+  stmt->condition->apply(cond);
+  auto outer = stmts;
+  auto branch = [&](const IR::Statement* body) {
+    stmts.clear();
+    visit(body);
+    for (auto& b : stmts) {
+      if (b.starts_stage) {
+        ::error("%1%: register read in a conditional branch is not supported", stmt);
       }
+      for (auto l : b.lines) s.lines.push_back(cstring("    ") + l);
+      s.reads.insert(b.reads.begin(), b.reads.end());
+      s.writes.insert(b.writes.begin(), b.writes.end());
+      s.locals.insert(b.locals.begin(), b.locals.end());
+      s.stores.insert(b.stores.begin(), b.stores.end());
+      s.dsp |= b.dsp;
     }
+  };
+  s.lines.push_back(cstring("if (") + cond.bsv + ") begin");
+  branch(stmt->ifTrue);
+  s.lines.push_back("end");
+  if (stmt->ifFalse != nullptr) {
+    s.lines.push_back("else begin");
+    branch(stmt->ifFalse);
+    s.lines.push_back("end");
   }
-  return is_drop;
+  stmts = outer;
+  stmts.push_back(s);
+  return false;
 }
 
-bool ActionCodeGen::isNoAction(const IR::P4Action* action) {
-  bool is_nop = false;
-  if (action->body == nullptr) {
-    return true;
+bool ActionCodeGen::preorder(const IR::Statement* stmt) {
+  if (!stmt->is<IR::EmptyStatement>()) {
+    ::error("%1%: unsupported statement in action", stmt);
   }
-  if (action->body->components.size() == 0) {
-    return true;
+  return false;
+}
+
+// Statements run in order within a stage, a new stage starts when a wide
+// arithmetic statement reads the result of another one, or when a statement
+// waits for a register response.
+std::vector<std::vector<const ActionStmt*>> ActionCodeGen::schedule() const {
+  std::vector<std::vector<const ActionStmt*>> stages(1);
+  std::set<cstring> dsp_written;
+  for (auto& s : stmts) {
+    bool chained = s.starts_stage;
+    if (s.dsp) {
+      for (auto r : s.reads) {
+        for (auto w : dsp_written) {
+          chained |= overlaps(r, w);
+        }
+      }
+    }
+    if (chained && !stages.back().empty()) {
+      stages.emplace_back();
+      dsp_written.clear();
+    }
+    stages.back().push_back(&s);
+    if (s.dsp) {
+      dsp_written.insert(s.writes.begin(), s.writes.end());
+    }
   }
-  return is_nop;
+  return stages;
 }
 
-void ActionCodeGen::postorder(const IR::P4Action* action) {
-  auto stmt = action->body->to<IR::BlockStatement>();
+// Stage functions are closures over the register and variable fifos of the
+// control module. Action variables are passed to the next stage in order
+// through '<fn>_vars_ff', as the Engine keeps packets in order.
+void ActionCodeGen::emitStage(cstring fn, int idx, int count, cstring param_type, cstring tag,
+                              bool has_params, cstring vars_type,
+                              const std::vector<const ActionStmt*>& stage) {
+  auto out = &control->action_builder;
+  std::set<cstring> used;
+  std::set<cstring> stored;
+  for (auto s : stage) {
+    used.insert(s->locals.begin(), s->locals.end());
+    stored.insert(s->stores.begin(), s->stores.end());
+  }
+  out->append_line("function ActionValue#(MetadataRequest) %s_step_%d (MetadataRequest req, %s param);", fn, idx, param_type);
+  out->incr_indent();
+  out->append_line("actionvalue");
+  out->incr_indent();
+  out->append_line("MetadataRequest rsp = req;");
+  bool carried = vars_type != nullptr && idx > 1;
+  if (carried) {
+    out->append_line("let vars <- toGet(%s_vars_ff[%d]).get;", fn, idx - 2);
+  }
+  for (auto v : variables) {
+    out->append_line("%s %s = %s;", v.second, v.first, carried ? cstring("vars.") + v.first : cstring("?"));
+  }
+  if (has_params) {
+    out->append_line("if (param matches tagged %s .p) begin", tag);
+    out->incr_indent();
+  }
+  for (auto l : used) {
+    for (auto line : locals.at(l).load) {
+      out->append_line("%s", line);
+    }
+  }
+  for (auto s : stage) {
+    for (auto line : s->lines) {
+      out->append_line("%s", line);
+    }
+  }
+  for (auto l : stored) {
+    out->append_line("%s", locals.at(l).store);
+  }
+  if (has_params) {
+    out->decr_indent();
+    out->append_line("end");
+  }
+  if (vars_type != nullptr && idx < count) {
+    out->emitIndent();
+    out->appendFormat("%s_vars_ff[%d].enq(%s {", fn, idx - 1, vars_type);
+    for (auto v : variables) {
+      out->appendFormat("%s: %s", v.first, v.first);
+      if (v.first != variables.rbegin()->first) {
+        out->append(", ");
+      }
+    }
+    out->append("});");
+    out->newline();
+  }
+  out->append_line("return rsp;");
+  out->decr_indent();
+  out->append_line("endactionvalue");
+  out->decr_indent();
+  out->append_line("endfunction");
+}
 
-  if (stmt == nullptr) {
+void ActionCodeGen::postorder(const IR::P4Action* action) {
+  cstring name = nameFromAnnotation(action->annotations, action->name);
+  cstring type = CamelCase(name);
+  const IR::P4Table* table = control->action_to_table[name];
+  if (table == nullptr) {
+    ::error("unable to find table from action %s", name);
     return;
   }
-  emitActionBegin(action);
-  if (isDropAction(action)) {
-    emitDropAction(action);
-  } else if (isNoAction(action)) {
-    emitNoAction(action);
-  } else {
-    emitModifyAction(action);
+  cstring table_type = CamelCase(nameFromAnnotation(table->annotations, table->name));
+  cstring fn = camelCase(name);
+  auto stages = schedule();
+  builder->append_line("typedef Engine#(%d, MetadataRequest, %sParam) %sAction;", stages.size(), table_type, type);
+  cstring vars_type = nullptr;
+  if (stages.size() > 1 && !variables.empty()) {
+    vars_type = type + "Vars";
+    builder->append_line("typedef struct {");
+    builder->incr_indent();
+    for (auto v : variables) {
+      builder->append_line("%s %s;", v.second, v.first);
+    }
+    builder->decr_indent();
+    builder->append_line("} %s deriving (Bits, Eq, FShow);", vars_type);
+    control->action_builder.append_line("Vector#(%d, FIFOF#(%s)) %s_vars_ff <- Vector::replicateM(mkFIFOF);",
+                                        stages.size() - 1, vars_type, fn);
+  }
+  for (size_t i = 0; i < stages.size(); i++) {
+    emitStage(fn, i + 1, stages.size(), table_type + "Param", type + "ReqT",
+              action->parameters->size() != 0, vars_type, stages[i]);
+  }
+  control->action_stages[name] = stages.size();
+  for (auto r : reg_reads) {
+    if (reg_writes.count(r) != 0) {
+      ::warning("%1%: register %2% is read and written without a fusable pattern, "
+                "the update is not atomic", action, control->registers.at(r).name);
+    }
   }
+  LOG1("action " << name << ": " << stmts.size() << " statements in " << stages.size() << " stages");
 }
 
 }  // namespace FPGA
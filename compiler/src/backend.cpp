@@ -1,7 +1,11 @@
 
 #include "backend.h"
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <fstream>
+#include <set>
+#include <sstream>
+#include <vector>
 
 #include "ir/ir.h"
 #include "lib/error.h"
@@ -14,11 +18,31 @@
 #include "ftype.h"
 #include "foptions.h"
 #include "bsvprogram.h"
+#include "timer.h"
 
 namespace FPGA {
 
+// Leave the file alone if its content is unchanged, so the timestamp does
+// not trigger a rebuild of everything that depends on it.
+bool write_if_changed(const boost::filesystem::path& path, cstring content) {
+    std::ifstream in(path.native(), std::ios::binary);
+    if (in) {
+        std::ostringstream old;
+        old << in.rdbuf();
+        std::string data(content.c_str());
+        if (old.str() == data) {
+            LOG1("unchanged " << path.native());
+            return false;
+        }
+    }
+    std::ofstream(path.native(), std::ios::binary) << content.c_str();
+    LOG1("wrote " << path.native());
+    return true;
+}
+
 void run_fpga_backend(const FPGAOptions& options, const IR::ToplevelBlock* toplevel,
-                      P4::ReferenceMap* refMap, P4::TypeMap* typeMap) {
+                      P4::ReferenceMap* refMap, P4::TypeMap* typeMap,
+                      FPGA::Profiler* profgen) {
     CHECK_NULL(toplevel);
     CHECK_NULL(toplevel->getMain());
 
@@ -30,6 +54,8 @@ void run_fpga_backend(const FPGAOptions& options, const IR::ToplevelBlock* tople
 
     // create Program.bsv
     FPGAProgram fpgaprog(toplevel, refMap, typeMap);
+    fpgaprog.datapathWidth = options.datapathWidth;
+    fpgaprog.headerVector = options.headerVector;
     if (!fpgaprog.build())
       { ::error("FPGAprog build failed"); return; }
 
@@ -74,17 +100,24 @@ void run_fpga_backend(const FPGAOptions& options, const IR::ToplevelBlock* tople
     boost::filesystem::path simFile("matchtable_model.cpp");
     boost::filesystem::path simPath = dir / simFile;
 
-    std::ofstream(parserPath.native())   <<  bsv.getParserBuilder().toString();
-    std::ofstream(deparserPath.native()) <<  bsv.getDeparserBuilder().toString();
-    std::ofstream(structPath.native())   <<  bsv.getStructBuilder().toString();
-    std::ofstream(controlPath.native())  <<  bsv.getControlBuilder().toString();
-    std::ofstream(unionPath.native())    <<  bsv.getUnionBuilder().toString();
-    std::ofstream(apiDefPath.native())  <<  bsv.getAPIDefBuilder().toString();
-    std::ofstream(apiDeclPath.native())   <<  bsv.getAPIDeclBuilder().toString();
-    std::ofstream(progDeclPath.native())   <<  bsv.getProgDeclBuilder().toString();
-    std::ofstream(apiTypeDefPath.native()) << bsv.getConnectalTypeBuilder().toString();
-
-    std::ofstream(simFile.native())      <<  cpp.getSimBuilder().toString();
+    PassTimer timer("backend.write");
+    int changed = 0;
+    changed += write_if_changed(parserPath,   bsv.getParserBuilder().toString());
+    changed += write_if_changed(deparserPath, bsv.getDeparserBuilder().toString());
+    changed += write_if_changed(structPath,   bsv.getStructBuilder().toString());
+    changed += write_if_changed(controlPath,  bsv.getControlBuilder().toString());
+    changed += write_if_changed(unionPath,    bsv.getUnionBuilder().toString());
+    changed += write_if_changed(apiDefPath,   bsv.getAPIDefBuilder().toString());
+    changed += write_if_changed(apiDeclPath,  bsv.getAPIDeclBuilder().toString());
+    changed += write_if_changed(progDeclPath, bsv.getProgDeclBuilder().toString());
+    changed += write_if_changed(apiTypeDefPath, bsv.getConnectalTypeBuilder().toString());
+
+    changed += write_if_changed(simFile,      cpp.getSimBuilder().toString());
+    LOG1(changed << " of 10 generated files changed");
+
+    if (options.report == "json" && profgen != nullptr) {
+      generate_report(options, &fpgaprog, profgen);
+    }
 }
 
 void generate_metadata_profile(const IR::P4Program* program) {
@@ -117,4 +150,126 @@ void generate_partition(const FPGAOptions& options, const IR::P4Program* program
     program->apply(toP4);
 }
 
+// Metadata entering partition 'idx' from the previous pipeline, in the
+// order it is serialized on the wire: the previous pipeline packs it out of
+// MetadataT with packPartitionMetadata<idx>, this one restores it with
+// unpackPartitionMetadata<idx>. Struct members of metadata and standard
+// metadata fields are Maybe in MetadataT.
+void generate_partition_metadata(const FPGAOptions& options, const std::map<cstring, int>& fields, cstring idx) {
+    Util::PathName pathname(options.file);
+    auto filename = pathname.getBasename() + idx + cstring("_metadata.bsv");
+    boost::filesystem::path dir(options.outputFile);
+    boost::filesystem::create_directory(dir);
+    boost::filesystem::path metaPath = dir / boost::filesystem::path(filename.c_str());
+
+    // BSV member name, location in MetadataT and width of each field
+    struct Member {
+        std::string name;
+        std::vector<std::string> path;
+        int bits;
+    };
+    std::vector<Member> members;
+    for (auto f : fields) {
+        std::string path(f.first.c_str());
+        std::vector<std::string> names;
+        std::stringstream ss(path);
+        std::string n;
+        while (std::getline(ss, n, '.')) names.push_back(n);
+        bool meta = names[0] == "meta" && names.size() == 3;
+        bool standard = names[0] == "standard_metadata" && names.size() == 2;
+        if (!meta && !standard) {
+            ::warning("partition %1%: %2% is not serialized, only fields of metadata structs "
+                      "and standard metadata are", idx, f.first);
+            continue;
+        }
+        std::replace(path.begin(), path.end(), '.', '_');
+        members.push_back({path, names, f.second});
+    }
+
+    CodeBuilder builder;
+    if (members.empty()) {
+        builder.append_line("// no metadata is live into partition %s", idx);
+        write_if_changed(metaPath, builder.toString());
+        return;
+    }
+    builder.append_line("import DefaultValue::*;");
+    builder.append_line("import StructDefines::*;");
+    builder.append_line("import Vector::*;");
+    builder.newline();
+    int width = 0;
+    builder.append_line("typedef struct {");
+    builder.incr_indent();
+    for (auto m : members) {
+        builder.append_line("Bit#(%d) %s;", m.bits, m.name);
+        width += m.bits;
+    }
+    builder.decr_indent();
+    builder.append_line("} PartitionMetadata%sT deriving (Bits, Eq, FShow);", idx);
+    builder.append_line("// %d bits, %d beats of 128 bits", width, (width + 127) / 128);
+    builder.append_line("typedef TDiv#(TAdd#(SizeOf#(PartitionMetadata%sT), 127), 128) PartitionMetadata%sBeats;", idx, idx);
+    builder.newline();
+
+    builder.append_line("function PartitionMetadata%sT packPartitionMetadata%s(MetadataT meta);", idx, idx);
+    builder.incr_indent();
+    builder.append_line("PartitionMetadata%sT p = ?;", idx);
+    for (auto m : members) {
+        auto& names = m.path;
+        if (names[0] == "meta") {
+            builder.append_line("p.%s = fromMaybe(defaultValue, meta.meta.%s).%s;", m.name, names[1], names[2]);
+        } else {
+            builder.append_line("p.%s = fromMaybe(0, meta.standard_metadata.%s);", m.name, names[1]);
+        }
+    }
+    builder.append_line("return p;");
+    builder.decr_indent();
+    builder.append_line("endfunction");
+    builder.newline();
+
+    builder.append_line("function MetadataT unpackPartitionMetadata%s(PartitionMetadata%sT p, MetadataT meta);", idx, idx);
+    builder.incr_indent();
+    std::set<std::string> structs;
+    for (auto m : members) {
+        if (m.path[0] == "meta") structs.insert(m.path[1]);
+    }
+    for (auto s : structs) {
+        builder.append_line("let m_%s = fromMaybe(defaultValue, meta.meta.%s);", s, s);
+    }
+    for (auto m : members) {
+        auto& names = m.path;
+        if (names[0] == "meta") {
+            builder.append_line("m_%s.%s = p.%s;", names[1], names[2], m.name);
+        } else {
+            builder.append_line("meta.standard_metadata.%s = tagged Valid p.%s;", names[1], m.name);
+        }
+    }
+    for (auto s : structs) {
+        builder.append_line("meta.meta.%s = tagged Valid m_%s;", s, s);
+    }
+    builder.append_line("return meta;");
+    builder.decr_indent();
+    builder.append_line("endfunction");
+    builder.newline();
+
+    builder.append_line("function Vector#(PartitionMetadata%sBeats, Bit#(128)) partitionMetadata%sBeats(PartitionMetadata%sT p);", idx, idx, idx);
+    builder.incr_indent();
+    builder.append_line("return unpack(zeroExtend(pack(p)));");
+    builder.decr_indent();
+    builder.append_line("endfunction");
+    builder.newline();
+
+    builder.append_line("function PartitionMetadata%sT partitionMetadata%sFromBeats(Vector#(PartitionMetadata%sBeats, Bit#(128)) beats);", idx, idx, idx);
+    builder.incr_indent();
+    builder.append_line("return unpack(truncate(pack(beats)));");
+    builder.decr_indent();
+    builder.append_line("endfunction");
+    write_if_changed(metaPath, builder.toString());
+}
+
+void generate_partition_report(const FPGAOptions& options, FPGA::Partitioner* partgen) {
+    boost::filesystem::path dir(options.outputFile);
+    boost::filesystem::create_directory(dir);
+    boost::filesystem::path reportPath = dir / boost::filesystem::path("partition.prof");
+    std::ofstream(reportPath.native()) << partgen->getPartitioner().toString();
+}
+
 }  // namespace FPGA
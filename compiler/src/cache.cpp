@@ -0,0 +1,86 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sstream>
+#include "cache.h"
+#include "lib/nullstream.h"
+#include "frontends/p4/toP4/toP4.h"
+
+namespace FPGA {
+
+// identity of the running compiler binary, entries written by another
+// build of the compiler must not be picked up. The path, size and mtime are
+// enough to tell builds apart without reading the whole executable.
+static std::string compilerHash() {
+  boost::system::error_code ec;
+  boost::filesystem::path exe("/proc/self/exe");
+  std::stringstream id;
+  id << boost::filesystem::read_symlink(exe, ec).string() << ':'
+     << boost::filesystem::file_size(exe, ec) << ':'
+     << boost::filesystem::last_write_time(exe, ec);
+  return id.str();
+}
+
+MidEndCache::MidEndCache(const FPGAOptions& options) {
+  std::stringstream key;
+  FILE* in = const_cast<FPGAOptions&>(options).preprocess();
+  if (in != nullptr) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+      key.write(buf, n);
+    options.closeInput(in);
+  }
+  key << static_cast<int>(options.langVersion) << options.preprocessor_options;
+  key << compilerHash();
+  std::stringstream name;
+  name << std::hex << std::hash<std::string>()(key.str()) << ".p4";
+  boost::filesystem::path dir(options.cacheDir.c_str());
+  boost::filesystem::create_directories(dir);
+  path = (dir / boost::filesystem::path(name.str())).c_str();
+}
+
+bool MidEndCache::lookup() const {
+  bool hit = boost::filesystem::exists(path.c_str());
+  LOG1("mid-end cache " << (hit ? "hit " : "miss ") << path);
+  return hit;
+}
+
+// write to a temporary file first, an interrupted compile must not leave
+// a truncated entry behind
+void MidEndCache::store(const IR::P4Program* program) const {
+  cstring tmp = path + ".tmp";
+  {
+    auto stream = openFile(tmp, true);
+    if (stream == nullptr) return;
+    P4::ToP4 toP4(stream, false, nullptr);
+    program->apply(toP4);
+    delete stream;
+  }
+  boost::filesystem::rename(tmp.c_str(), path.c_str());
+}
+
+// true if the entry is gone afterwards
+bool MidEndCache::remove() const {
+  boost::system::error_code ec;
+  boost::filesystem::remove(path.c_str(), ec);
+  return !boost::filesystem::exists(path.c_str(), ec);
+}
+
+}  // namespace FPGA
@@ -0,0 +1,254 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "dependency.h"
+#include "fcontrol.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace FPGA {
+
+FieldAccess FieldAccessCollector::toAccess(const IR::Expression* expr) const {
+  if (expr->is<IR::Slice>()) {
+    expr = expr->to<IR::Slice>()->e0;
+  }
+  FieldAccess access = {expr->toString(), nullptr};
+  if (expr->is<IR::Member>()) {
+    auto m = expr->to<IR::Member>();
+    auto type = control->program->typeMap->getType(m->expr, true);
+    if (type->is<IR::Type_StructLike>()) {
+      access.field = type->to<IR::Type_StructLike>()->getField(m->member);
+    }
+  }
+  return access;
+}
+
+bool FieldAccessCollector::preorder(const IR::AssignmentStatement* stmt) {
+  writes.insert(toAccess(stmt->left));
+  // a slice only overwrites part of the field
+  if (stmt->left->is<IR::Slice>()) {
+    reads.insert(toAccess(stmt->left));
+  }
+  visit(stmt->right);
+  return false;
+}
+
+bool FieldAccessCollector::preorder(const IR::Member* member) {
+  reads.insert(toAccess(member));
+  return false;
+}
+
+// only variables declared in the control carry state between tables
+bool FieldAccessCollector::preorder(const IR::PathExpression* path) {
+  auto decl = control->program->refMap->getDeclaration(path->path, true);
+  if (decl->is<IR::Declaration_Variable>()) {
+    reads.insert(toAccess(path));
+  }
+  return false;
+}
+
+bool FieldAccessCollector::preorder(const IR::MethodCallExpression* expr) {
+  auto mi = P4::MethodInstance::resolve(expr,
+                                        control->program->refMap,
+                                        control->program->typeMap);
+  bool opaque = false;
+  if (mi->is<P4::ActionCall>()) {
+    visit(mi->to<P4::ActionCall>()->action->body);
+  } else if (mi->is<P4::BuiltInMethod>()) {
+    auto bim = mi->to<P4::BuiltInMethod>();
+    if (bim->name == IR::Type_Header::isValid) {
+      reads.insert(toAccess(bim->appliedTo));
+    } else {
+      writes.insert(toAccess(bim->appliedTo));
+    }
+  } else if (mi->is<P4::ExternMethod>()) {
+    // register, counter, etc. are shared by all tables using the instance
+    auto m = expr->method->to<IR::Member>();
+    FieldAccess access = {cstring("extern.") + m->expr->toString(), nullptr};
+    reads.insert(access);
+    writes.insert(access);
+    opaque = true;
+  } else if (mi->is<P4::ExternFunction>()) {
+    auto ef = mi->to<P4::ExternFunction>();
+    FieldAccess access = {cstring("extern.") + ef->method->name.toString(), nullptr};
+    reads.insert(access);
+    writes.insert(access);
+    opaque = true;
+  }
+  // arguments of extern calls may be out parameters
+  for (auto arg : *expr->arguments) {
+    visit(arg);
+    if (opaque && (arg->is<IR::Member>() || arg->is<IR::PathExpression>())) {
+      writes.insert(toAccess(arg));
+    }
+  }
+  return false;
+}
+
+// hdr.ipv4 overlaps hdr.ipv4.ttl, but not hdr.ipv4_opt
+static bool overlaps(const std::set<FieldAccess>& a, const std::set<FieldAccess>& b) {
+  for (auto x : a) {
+    for (auto y : b) {
+      auto lx = x.path.size();
+      auto ly = y.path.size();
+      auto n = std::min(lx, ly);
+      if (strncmp(x.path.c_str(), y.path.c_str(), n) != 0) continue;
+      if (lx == ly) return true;
+      if (lx > ly && x.path.c_str()[n] == '.') return true;
+      if (ly > lx && y.path.c_str()[n] == '.') return true;
+    }
+  }
+  return false;
+}
+
+// Actions store whole headers and whole metadata structs, so a write to
+// hdr.ipv4.ttl is copied back as hdr.ipv4. Returns nullptr for writes that
+// have no member in MetadataT, and "" for extern state.
+cstring TableDependencyGraph::mergeUnit(const FieldAccess& access) const {
+  if (access.path.startsWith("extern.")) return "";
+  std::vector<cstring> names;
+  const char* p = access.path.c_str();
+  while (true) {
+    const char* dot = strchr(p, '.');
+    names.push_back(dot == nullptr ? cstring(p) : cstring(std::string(p, dot - p)));
+    if (dot == nullptr) break;
+    p = dot + 1;
+  }
+  if (names.size() < 2 || strchr(access.path.c_str(), '[') != nullptr) return nullptr;
+  auto& model = control->program->v1model.ingress;
+  auto params = control->controlBlock->container->type->applyParams;
+  if (names[0] == params->getParameter(model.headersParam.index)->name) {
+    return cstring("hdr.") + names[1];
+  }
+  if (names[0] == params->getParameter(model.metadataParam.index)->name) {
+    return cstring("meta.") + names[1];
+  }
+  if (names[0] == params->getParameter(model.standardMetadataParam.index)->name) {
+    return cstring("standard_metadata.") + names[1];
+  }
+  return nullptr;
+}
+
+bool TableDependencyGraph::dependsOn(const IR::P4Table* later, const IR::P4Table* earlier) const {
+  auto& w = writes.at(earlier);
+  return overlaps(w, reads.at(later)) || overlaps(w, writes.at(later));
+}
+
+const std::vector<const CFG::TableNode*>* TableDependencyGraph::getStage(cstring table) const {
+  auto it = stage_index.find(table);
+  if (it == stage_index.end()) return nullptr;
+  return &stages.at(it->second);
+}
+
+void TableDependencyGraph::build() {
+  for (auto t : control->tables) {
+    auto table = t.second;
+    FieldAccessCollector collector(control);
+    auto keys = table->getKey();
+    if (keys != nullptr) {
+      for (auto key : keys->keyElements) {
+        collector.reads.insert(collector.toAccess(key->expression));
+      }
+    }
+    for (auto a : table->getActionList()->actionList) {
+      auto decl = control->refMap->getDeclaration(a->getPath(), true);
+      if (decl->is<IR::P4Action>()) {
+        decl->to<IR::P4Action>()->body->apply(collector);
+      }
+    }
+    reads[table] = collector.reads;
+    writes[table] = collector.writes;
+    auto& m = merges[table];
+    for (auto w : collector.writes) {
+      auto unit = mergeUnit(w);
+      if (unit == nullptr) {
+        unmergeable.insert(table);
+        continue;
+      }
+      if (unit != "") m.insert(unit);
+    }
+  }
+
+  for (auto a : control->tables) {
+    for (auto b : control->tables) {
+      if (a.second != b.second && dependsOn(b.second, a.second)) {
+        LOG1("table " << b.first << " depends on " << a.first);
+      }
+    }
+  }
+
+  if (control->cfg == nullptr) return;
+
+  // a table applied more than once has its fifos shared by all call sites
+  std::map<const IR::P4Table*, int> applies;
+  for (auto node : control->cfg->allNodes) {
+    if (node->is<CFG::TableNode>()) {
+      applies[node->to<CFG::TableNode>()->table]++;
+    }
+  }
+  // tables without key bypass the in-order completion buffer in Table.bsv
+  auto parallel = [&](const CFG::Node* node) {
+    if (!node->is<CFG::TableNode>()) return false;
+    auto table = node->to<CFG::TableNode>()->table;
+    return applies[table] == 1 && table->getKey() != nullptr;
+  };
+
+  std::set<const CFG::Node*> visited;
+  for (auto node : control->cfg->allNodes) {
+    if (!parallel(node) || visited.count(node) != 0) continue;
+    std::vector<const CFG::TableNode*> stage;
+    const CFG::Node* curr = node;
+    stage.push_back(curr->to<CFG::TableNode>());
+    visited.insert(curr);
+    while (curr->successors.size() == 1) {
+      auto edge = *curr->successors.edges.begin();
+      auto next = edge->endpoint;
+      if (!edge->isUnconditional() || !parallel(next)) break;
+      if (next->predecessors.size() != 1 || visited.count(next) != 0) break;
+      auto next_table = next->to<CFG::TableNode>()->table;
+      // the join copies the writes of later tables over the first one's
+      // response, so they must be whole members no other table writes
+      bool independent = unmergeable.count(next_table) == 0;
+      for (auto s : stage) {
+        if (!independent) break;
+        if (dependsOn(next_table, s->table)) {
+          independent = false;
+          break;
+        }
+        for (auto unit : merges.at(next_table)) {
+          if (merges.at(s->table).count(unit) != 0) {
+            independent = false;
+            break;
+          }
+        }
+      }
+      if (!independent) break;
+      stage.push_back(next->to<CFG::TableNode>());
+      visited.insert(next);
+      curr = next;
+    }
+    if (stage.size() < 2) continue;
+    for (auto s : stage) {
+      stage_index[s->name] = stages.size();
+    }
+    stages.push_back(stage);
+  }
+}
+
+}  // namespace FPGA
@@ -18,9 +18,12 @@
 #include "fcontrol.h"
 #include "table.h"
 #include "action.h"
+#include "dependency.h"
 #include "fstruct.h"
 #include "funion.h"
+#include "liveness.h"
 #include "string_utils.h"
+#include "timer.h"
 #include "vector_utils.h"
 
 namespace FPGA {
@@ -146,6 +149,9 @@ bool FPGAControl::build() {
     } else if (b->is<IR::ExternBlock>()) {
       auto ctrblk = b->to<IR::ExternBlock>();
       LOG1("extern " << ctrblk);
+      if (ctrblk->type->name == program->v1model.registers.name) {
+        addRegister(ctrblk);
+      }
     } else {
       ::error("Unexpected block %s nested within control", b->toString());
     }
@@ -156,9 +162,45 @@ bool FPGAControl::build() {
     metadata_to_table[n.first].insert(action_to_table[n.second]);
   }
 
+  deps = new TableDependencyGraph(this);
+  deps->build();
+  for (auto stage : deps->stages) {
+    LOG1("parallel stage " << stage.front()->name << " .. " << stage.back()->name);
+  }
+
   return true;
 }
 
+// register<bit<W>>(N) r, optionally split by index with @banks(B)
+void FPGAControl::addRegister(const IR::ExternBlock* block) {
+  auto decl = block->node->to<IR::Declaration_Instance>();
+  auto type = decl->type->to<IR::Type_Specialized>();
+  auto size = block->getParameterValue(program->v1model.registers.sizeParam.name);
+  if (type == nullptr || type->arguments->size() != 1 ||
+      size == nullptr || !size->is<IR::Constant>()) {
+    ::error("%1%: unsupported register declaration", decl);
+    return;
+  }
+  RegisterInfo info;
+  info.name = nameFromAnnotation(decl->annotations, decl->name);
+  info.size = size->to<IR::Constant>()->asInt();
+  info.width = typeMap->getTypeType(type->arguments->at(0), true)->width_bits();
+  auto banks = decl->annotations->getSingle("banks");
+  if (banks != nullptr) {
+    auto n = banks->expr.size() == 1 ? banks->expr.at(0)->to<IR::Constant>() : nullptr;
+    if (n == nullptr || n->asInt() < 1 || (n->asInt() & (n->asInt() - 1)) != 0 ||
+        n->asInt() > info.size) {
+      ::error("%1%: @banks expects a power of two no larger than the register", banks);
+    } else {
+      info.banks = n->asInt();
+    }
+  }
+  registers.emplace(decl->name.name, info);
+  externs.emplace(info.name, block);
+  LOG1("register " << info.name << " " << info.size << "x" << info.width <<
+       " in " << info.banks << " banks");
+}
+
 void FPGAControl::emitEntryRule(BSVProgram & bsv, const CFG::Node* node) {
   builder->append_format("rule rl_entry if (entry_req_ff.notEmpty);");
   builder->incr_indent();
@@ -173,7 +215,7 @@ void FPGAControl::emitEntryRule(BSVProgram & bsv, const CFG::Node* node) {
   } else {
     BUG_CHECK(node->successors.size() == 1, "Expected 1 start node for %1%", node);
     auto start = (*(node->successors.edges.begin()))->endpoint;
-    builder->append_format("%s_req_ff.enq(req);", start->name);
+    builder->append_format("%s_req_ff.enq(narrowMeta(req));", start->name);
     builder->append_format("dbprint(3, $format(\"%s\", fshow(meta)));", start->name);
   }
   builder->decr_indent();
@@ -187,7 +229,7 @@ void FPGAControl::emitTableRule(BSVProgram & bsv, const CFG::TableNode* node) {
   builder->append_format("rule rl_%s if (%s_rsp_ff.notEmpty);", name, name);
   builder->incr_indent();
   builder->append_format("%s_rsp_ff.deq;", name);
-  builder->append_format("let _rsp = %s_rsp_ff.first;", name);
+  builder->append_format("let _rsp = widenMeta(%s_rsp_ff.first);", name);
   // find next states
   builder->append_line("let meta = _rsp.meta;");
   builder->append_line("let pkt = _rsp.pkt;");
@@ -198,7 +240,7 @@ void FPGAControl::emitTableRule(BSVProgram & bsv, const CFG::TableNode* node) {
       builder->append_line("default: begin");
       builder->incr_indent();
       builder->append_line("MetadataRequest req = MetadataRequest { pkt : pkt, meta : meta};");
-      builder->append_line("%s_req_ff.enq(req);", s->endpoint->name);
+      builder->append_line("%s_req_ff.enq(narrowMeta(req));", s->endpoint->name);
       builder->append_format("dbprint(3, $format(\"default \", fshow(meta)));");
       builder->decr_indent();
       builder->append_line("end");
@@ -206,7 +248,7 @@ void FPGAControl::emitTableRule(BSVProgram & bsv, const CFG::TableNode* node) {
       builder->append_line("%s: begin", s->label);
       builder->incr_indent();
       builder->append_line("MetadataRequest req = MetadataRequest { pkt : pkt, meta : meta};");
-      builder->append_line("%s_req_ff.enq(req);", s->endpoint->name);
+      builder->append_line("%s_req_ff.enq(narrowMeta(req));", s->endpoint->name);
       builder->append_format("dbprint(3, $format(\"%s \", fshow(meta)));", s->label);
       builder->decr_indent();
       builder->append_line("end");
@@ -218,6 +260,60 @@ void FPGAControl::emitTableRule(BSVProgram & bsv, const CFG::TableNode* node) {
   builder->append_line("endrule");
 }
 
+// Tables in a stage have no dependency on each other. Metadata is forked
+// to all tables at once and the responses are joined in request order,
+// headers, metadata and standard metadata written by later tables override
+// the copy returned by the first.
+// Routing to the next node is left to the rule of the last table.
+void FPGAControl::emitStageRule(BSVProgram & bsv, const std::vector<const CFG::TableNode*>& stage) {
+  auto first = stage.front()->name;
+  auto last = stage.back()->name;
+  builder->append_format("rule rl_%s_fork if (%s_req_ff.notEmpty);", first, first);
+  builder->incr_indent();
+  builder->append_format("%s_req_ff.deq;", first);
+  builder->append_format("let _req = widenMeta(%s_req_ff.first);", first);
+  for (auto t : stage) {
+    builder->append_format("%s_par_req_ff.enq(_req);", t->name);
+  }
+  builder->append_format("dbprint(3, $format(\"fork %s\", fshow(_req.meta)));", first);
+  builder->decr_indent();
+  builder->append_line("endrule");
+
+  builder->emitIndent();
+  builder->appendFormat("rule rl_%s_join if (", last);
+  for (auto t : stage) {
+    builder->appendFormat("%s_par_rsp_ff.notEmpty", t->name);
+    if (t != stage.back()) {
+      builder->append(" && ");
+    }
+  }
+  builder->append(");");
+  builder->newline();
+  builder->incr_indent();
+  for (auto t : stage) {
+    builder->append_format("let %s_rsp <- toGet(%s_par_rsp_ff).get;", t->name, t->name);
+  }
+  builder->append_format("let meta = %s_rsp.meta;", first);
+  for (auto t : stage) {
+    if (t == stage.front()) continue;
+    for (auto unit : deps->getMergeWrites(t->table)) {
+      builder->append_format("meta.%s = %s_rsp.meta.%s;", unit, t->name, unit);
+    }
+    // actions also update the copy of a field that tables match on
+    for (auto w : deps->getWrites(t->table)) {
+      if (w.field == nullptr) continue;
+      if (program->ingress->metadata_to_table.count(w.field) == 0 &&
+          program->egress->metadata_to_table.count(w.field) == 0) continue;
+      auto fname = nameFromAnnotation(w.field->annotations, w.field->name);
+      builder->append_format("meta.meta.%s = %s_rsp.meta.meta.%s;", fname, t->name, fname);
+    }
+  }
+  builder->append_format("%s_rsp_ff.enq(narrowMeta(MetadataRequest {pkt: %s_rsp.pkt, meta: meta}));", last, first);
+  builder->append_format("dbprint(3, $format(\"join %s\", fshow(meta)));", last);
+  builder->decr_indent();
+  builder->append_line("endrule");
+}
+
 void FPGAControl::emitCondRule(BSVProgram & bsv, const CFG::IfNode* node) {
   //auto sig = cstring("w_") + node->name;
   auto name = node->name;
@@ -226,7 +322,7 @@ void FPGAControl::emitCondRule(BSVProgram & bsv, const CFG::IfNode* node) {
   auto stmt = node->statement->to<IR::IfStatement>();
   // LOG1(node << " succ " << node->successors.edges);
   builder->append_format("%s_req_ff.deq;", name);
-  builder->append_format("let _req = %s_req_ff.first;", name);
+  builder->append_format("let _req = widenMeta(%s_req_ff.first);", name);
   builder->append_line("let meta = _req.meta;");
 
   auto ifTrue = cstring("");
@@ -234,9 +330,9 @@ void FPGAControl::emitCondRule(BSVProgram & bsv, const CFG::IfNode* node) {
   for (auto e : node->successors.edges) {
     if (e->isBool()) {
       if (e->getBool()) {
-        ifTrue = e->getNode()->name + cstring("_req_ff.enq(_req);");
+        ifTrue = e->getNode()->name + cstring("_req_ff.enq(narrowMeta(_req));");
       } else {
-        ifFalse = e->getNode()->name + cstring("_req_ff.enq(_req);");
+        ifFalse = e->getNode()->name + cstring("_req_ff.enq(narrowMeta(_req));");
       }
     }
   }
@@ -245,7 +341,7 @@ void FPGAControl::emitCondRule(BSVProgram & bsv, const CFG::IfNode* node) {
   if (ifTrue != "") {
     builder->append_format("if (%s) begin", visitor.bsv);
     builder->incr_indent();
-    builder->append_format(ifTrue);
+    builder->append_format("%s", ifTrue);
     builder->append_format("dbprint(3, $format(\"%s true\", fshow(meta)));", node->name);
     builder->decr_indent();
     builder->append_line("end");
@@ -253,7 +349,7 @@ void FPGAControl::emitCondRule(BSVProgram & bsv, const CFG::IfNode* node) {
   if (ifFalse != "") {
     builder->append_line("else begin");
     builder->incr_indent();
-    builder->append_format(ifFalse);
+    builder->append_format("%s", ifFalse);
     builder->append_format("dbprint(3, $format(\"%s false\", fshow(meta)));", node->name);
     builder->decr_indent();
     builder->append_line("end");
@@ -268,7 +364,18 @@ void FPGAControl::emitDeclaration(BSVProgram & bsv) {
     auto name = nameFromAnnotation(b.second->annotations, b.second->name);
     auto type = CamelCase(name);
     // ensure NoAction is translated to noAction
-    builder->append_format("Control::%sAction %s_action <- mkEngine(toList(vec(step_1)));", type, camelCase(name));
+    auto fn = camelCase(name);
+    builder->emitIndent();
+    builder->appendFormat("Control::%sAction %s_action <- mkEngine(toList(vec(", type, fn);
+    int stages = action_stages.count(name) != 0 ? action_stages.at(name) : 1;
+    for (int i = 1; i <= stages; i++) {
+      builder->appendFormat("%s_step_%d", fn, i);
+      if (i != stages) {
+        builder->append(", ");
+      }
+    }
+    builder->append(")));");
+    builder->newline();
   }
   for (auto t : tables) {
     auto table = t.second->to<IR::P4Table>();
@@ -277,12 +384,120 @@ void FPGAControl::emitDeclaration(BSVProgram & bsv) {
     auto name = nameFromAnnotation(table->annotations, table->name);
     auto type = CamelCase(name);
     builder->append_line("%sMatchTable %s_table <- mkMatchTable_%s(\"%s\");", type, name, type, name);
-    builder->append_line("Control::%sTable %s <- mkTable(table_request, table_execute, %s_table);", type, name, name);
+    if (TableCodeGen::isShadow(table)) {
+      builder->append_line("%sMatchTable %s_shadow_table <- mkMatchTable_%s(\"%s_shadow\");", type, name, type, name);
+      builder->append_line("%sShadowTable %s_shadow <- mkShadowMatchTable(%s_table, %s_shadow_table);", type, name, name, name);
+      builder->append_line("Control::%sTable %s <- mkTable(table_request, table_execute, %s_shadow.table);", type, name, name);
+    } else {
+      builder->append_line("Control::%sTable %s <- mkTable(table_request, table_execute, %s_table);", type, name, name);
+    }
     builder->append_line("messageM(printType(typeOf(%s_table)));", name);
     builder->append_line("messageM(printType(typeOf(%s)));", name);
   }
 }
 
+int FPGAControl::tableId(cstring table) const {
+  int base = (this == program->egress) ? program->ingress->tables.size() : 0;
+  auto it = tables.find(table);
+  BUG_CHECK(it != tables.end(), "%1%: no such table", table);
+  return base + std::distance(tables.begin(), it);
+}
+
+// answers to adds and entry reads of every table, tagged with its TableId
+void FPGAControl::emitEntryInfo(BSVProgram & bsv) {
+  builder->append_line("FIFOF#(Tuple2#(Bit#(8), MatchEntryInfo)) entry_info_ff <- mkFIFOF;");
+  for (auto t : tables) {
+    if (t.second->getKey() == nullptr) continue;
+    builder->append_line("rule rl_%s_entry_info;", t.first);
+    builder->incr_indent();
+    builder->append_line("let v <- %s.entry_info.get;", t.first);
+    builder->append_line("entry_info_ff.enq(tuple2(%d, v));", tableId(t.first));
+    builder->decr_indent();
+    builder->append_line("endrule");
+  }
+}
+
+cstring FPGAControl::fifoType(cstring fifo) const {
+  auto it = fifo_types.find(fifo);
+  if (it == fifo_types.end()) return "MetadataRequest";
+  return it->second;
+}
+
+// One struct per distinct set of live Metadata members. Headers and standard
+// metadata are always carried, the deparser and the queues read them. A fifo
+// shared by several applies of a table carries the union of their sets.
+void FPGAControl::emitLiveTypes(BSVProgram & bsv, cstring cbtype) {
+  if (cfg == nullptr || liveness == nullptr) return;
+  std::map<cstring, std::set<cstring>> live;
+  for (auto node : cfg->allNodes) {
+    if (node->is<CFG::TableNode>()) {
+      auto& in = liveness->liveIn(node);
+      auto& out = liveness->liveOut(node);
+      live[node->name + "_req_ff"].insert(in.begin(), in.end());
+      live[node->name + "_rsp_ff"].insert(out.begin(), out.end());
+    } else if (node->is<CFG::IfNode>()) {
+      auto& in = liveness->liveIn(node);
+      live[node->name + "_req_ff"].insert(in.begin(), in.end());
+    }
+  }
+
+  auto members = program->metadataMembers();
+  std::map<std::set<cstring>, cstring> types;
+  for (auto l : live) {
+    if (l.second.size() == members.size()) continue;
+    auto it = types.find(l.second);
+    if (it != types.end()) {
+      fifo_types[l.first] = it->second;
+      continue;
+    }
+    cstring type = cbtype + "Live" + std::to_string(types.size());
+    types[l.second] = type;
+    fifo_types[l.first] = type;
+    LOG1(l.first << " carries " << l.second.size() << " of " << members.size() << " metadata");
+
+    builder->append_line("typedef struct {");
+    builder->incr_indent();
+    builder->append_line("PacketInstance pkt;");
+    builder->append_line("Headers hdr;");
+    builder->append_line("StandardMetadataT standard_metadata;");
+    for (auto m : members) {
+      if (l.second.count(m.first) == 0) continue;
+      builder->append_line("%s meta_%s;", m.second, m.first);
+    }
+    builder->decr_indent();
+    builder->append_line("} %s deriving (Bits, Eq, FShow);", type);
+    builder->append_line("instance NarrowMeta#(%s);", type);
+    builder->incr_indent();
+    builder->append_line("function %s narrowMeta(MetadataRequest req);", type);
+    builder->incr_indent();
+    builder->emitIndent();
+    builder->appendFormat("return %s {pkt: req.pkt, hdr: req.meta.hdr, standard_metadata: req.meta.standard_metadata", type);
+    for (auto m : members) {
+      if (l.second.count(m.first) == 0) continue;
+      builder->appendFormat(", meta_%s: req.meta.meta.%s", m.first, m.first);
+    }
+    builder->append("};");
+    builder->newline();
+    builder->decr_indent();
+    builder->append_line("endfunction");
+    // dead members come back as Invalid
+    builder->append_line("function MetadataRequest widenMeta(%s req);", type);
+    builder->incr_indent();
+    builder->append_line("MetadataT meta = defaultValue;");
+    builder->append_line("meta.hdr = req.hdr;");
+    builder->append_line("meta.standard_metadata = req.standard_metadata;");
+    for (auto m : members) {
+      if (l.second.count(m.first) == 0) continue;
+      builder->append_line("meta.meta.%s = req.meta_%s;", m.first, m.first);
+    }
+    builder->append_line("return MetadataRequest {pkt: req.pkt, meta: meta};");
+    builder->decr_indent();
+    builder->append_line("endfunction");
+    builder->decr_indent();
+    builder->append_line("endinstance");
+  }
+}
+
 void FPGAControl::emitFifo(BSVProgram & bsv) {
   builder->append_line("FIFOF#(MetadataRequest) entry_req_ff <- mkFIFOF;");
   builder->append_line("FIFOF#(MetadataRequest) entry_rsp_ff <- mkFIFOF;");
@@ -290,15 +505,19 @@ void FPGAControl::emitFifo(BSVProgram & bsv) {
     auto table = t.second->to<IR::P4Table>();
     auto name = nameFromAnnotation(table->annotations, table->name);
     auto type = CamelCase(name);
-    builder->append_line("FIFOF#(MetadataRequest) %s_req_ff <- mkFIFOF;", name);
-    builder->append_line("FIFOF#(MetadataRequest) %s_rsp_ff <- mkFIFOF;", name);
+    builder->append_line("FIFOF#(%s) %s_req_ff <- mkFIFOF;", fifoType(name + "_req_ff"), name);
+    builder->append_line("FIFOF#(%s) %s_rsp_ff <- mkFIFOF;", fifoType(name + "_rsp_ff"), name);
+    if (deps->getStage(name) != nullptr) {
+      builder->append_line("FIFOF#(MetadataRequest) %s_par_req_ff <- mkFIFOF;", name);
+      builder->append_line("FIFOF#(MetadataRequest) %s_par_rsp_ff <- mkFIFOF;", name);
+    }
   }
 
   if (cfg != nullptr) {
     for (auto node : cfg->allNodes) {
       if (node->is<CFG::IfNode>()) {
         auto n = node->to<CFG::IfNode>();
-        builder->append_line("FIFOF#(MetadataRequest) %s_req_ff <- mkFIFOF;", n->name);
+        builder->append_line("FIFOF#(%s) %s_req_ff <- mkFIFOF;", fifoType(n->name + "_req_ff"), n->name);
         //builder->append_line("PulseWire w_%s <- mkPulseWire;", n->name);
       }
     }
@@ -307,13 +526,31 @@ void FPGAControl::emitFifo(BSVProgram & bsv) {
   builder->append_line("FIFOF#(MetadataRequest) exit_rsp_ff <- mkFIFOF;");
 }
 
+// One request and one response fifo per access site, the register serves
+// them in fixed priority.
+void FPGAControl::emitRegisters(BSVProgram & bsv) {
+  for (auto r : registers) {
+    auto& info = r.second;
+    if (info.ports == 0) continue;
+    int asz = 1;
+    while ((1 << asz) < info.size) asz++;
+    builder->append_line("Vector#(%d, FIFOF#(RegRMWRequest#(%d, %d))) reg_%s_req_ff <- Vector::replicateM(mkFIFOF);", info.ports, asz, info.width, info.name);
+    builder->append_line("Vector#(%d, FIFOF#(RegResponse#(%d))) reg_%s_rsp_ff <- Vector::replicateM(mkFIFOF);", info.ports, info.width, info.name);
+    builder->append_line("RegisterRMW#(%d, %d, %d) reg_%s <- mkP4RegisterRMW(Vector::zipWith(toClient, reg_%s_req_ff, reg_%s_rsp_ff));", info.banks, asz, info.width, info.name, info.name, info.name);
+  }
+}
+
 void FPGAControl::emitConnection(BSVProgram & bsv) {
   // table to fifo
   for (auto t : tables) {
     auto table = t.second->to<IR::P4Table>();
     auto name = nameFromAnnotation(table->annotations, table->name);
     auto type = CamelCase(name);
-    builder->append_line("mkConnection(toClient(%s_req_ff, %s_rsp_ff), %s.prev_control_state);", name, name, name);
+    if (deps->getStage(name) != nullptr) {
+      builder->append_line("mkConnection(toClient(%s_par_req_ff, %s_par_rsp_ff), %s.prev_control_state);", name, name, name);
+    } else {
+      builder->append_line("mkConnection(widenClient(toClient(%s_req_ff, %s_rsp_ff)), %s.prev_control_state);", name, name, name);
+    }
 
     int idx = 0;
     for (auto a: table->getActionList()->actionList) {
@@ -331,8 +568,10 @@ void FPGAControl::emitConnection(BSVProgram & bsv) {
 
 void FPGAControl::emitTables() {
   CHECK_NULL(cpp_builder);
+  cpp_builder->append_line("#include <algorithm>");
   cpp_builder->append_line("#include <iostream>");
-  cpp_builder->append_line("#include <unordered_map>");
+  cpp_builder->append_line("#include <memory>");
+  cpp_builder->append_line("#include <vector>");
   cpp_builder->append_line("#ifdef __cplusplus");
   cpp_builder->append_line("extern \"C\" {");
   cpp_builder->append_line("#endif");
@@ -340,16 +579,21 @@ void FPGAControl::emitTables() {
   cpp_builder->append_line("#include <stdlib.h>");
   cpp_builder->append_line("#include <string.h>");
   cpp_builder->append_line("#include <stdint.h>");
+  cpp_builder->append_line("#ifdef __cplusplus");
+  cpp_builder->append_line("}");
+  cpp_builder->append_line("#endif");
+  TableCodeGen::emitCppModel(cpp_builder);
+  PassTimer timer("codegen.control.TableCodeGen");
   for (auto t : tables) {
     TableCodeGen visitor(this, builder, cpp_builder, type_builder);
     t.second->apply(visitor);
   }
-  cpp_builder->append_line("#ifdef __cplusplus");
-  cpp_builder->append_line("}");
-  cpp_builder->append_line("#endif");
 }
 
 void FPGAControl::emitActions(BSVProgram & bsv) {
+  PassTimer timer("codegen.control.ActionCodeGen");
+  // stage functions are indented as part of the module body
+  action_builder.incr_indent();
   for (auto b : actions) {
     ActionCodeGen visitor(this, bsv, builder);
     b.second->apply(visitor);
@@ -363,6 +607,7 @@ void FPGAControl::emitActions(BSVProgram & bsv) {
 }
 
 void FPGAControl::emitActionTypes(BSVProgram & bsv) {
+  PassTimer timer("codegen.control.UnionCodeGen");
   CodeBuilder* builder = &bsv.getUnionBuilder();
   UnionCodeGen visitor(this, builder);
   visitor.emit();
@@ -384,6 +629,23 @@ void FPGAControl::emitAPI(BSVProgram & bsv, cstring cbname) {
     api_def->appendFormat("%sReqT key, ", type);
     api_def->appendFormat("%sRspT val", type);
     api_def->appendLine(");");
+    if (TableCodeGen::getMatchType(tbl) != "exact") {
+      api_def->appendFormat("method Action %s_add_masked_entry(", name);
+      api_def->appendFormat("%sReqT key, ", type);
+      api_def->appendFormat("%sReqT mask, ", type);
+      api_def->appendFormat("%sRspT val", type);
+      api_def->appendLine(");");
+    }
+    // without an entry index, a delete or modify does not compile
+    if (TableCodeGen::isIndexed(tbl)) {
+      api_def->appendFormat("method Action %s_delete_entry(Bit#(32) index);", name);
+      api_def->newline();
+      api_def->appendFormat("method Action %s_modify_entry(Bit#(32) index, ", name);
+      api_def->appendFormat("%sRspT val", type);
+      api_def->appendLine(");");
+    }
+    api_def->appendFormat("method Action %s_read_entry(Bit#(32) index, Bit#(32) count);", name);
+    api_def->newline();
   }
   for (auto t : tables) {
     const IR::Key* key = t.second->getKey();
@@ -399,6 +661,32 @@ void FPGAControl::emitAPI(BSVProgram & bsv, cstring cbname) {
     api_decl->appendFormat("method %s_add_entry = prog", name);
     api_decl->appendFormat(".%s_add_entry;", name);
     api_decl->newline();
+
+    if (TableCodeGen::getMatchType(tbl) != "exact") {
+      prog_decl->appendFormat("method %s_add_masked_entry", name);
+      prog_decl->appendFormat("=%s", cbname);
+      prog_decl->appendFormat(".%s_add_masked_entry;", name);
+      prog_decl->newline();
+
+      api_decl->appendFormat("method %s_add_masked_entry = prog", name);
+      api_decl->appendFormat(".%s_add_masked_entry;", name);
+      api_decl->newline();
+    }
+
+    std::vector<const char*> methods = {"read_entry"};
+    if (TableCodeGen::isIndexed(tbl)) {
+      methods = {"delete_entry", "modify_entry", "read_entry"};
+    }
+    for (auto m : methods) {
+      prog_decl->appendFormat("method %s_%s", name, m);
+      prog_decl->appendFormat("=%s", cbname);
+      prog_decl->appendFormat(".%s_%s;", name, m);
+      prog_decl->newline();
+
+      api_decl->appendFormat("method %s_%s = prog", name, m);
+      api_decl->appendFormat(".%s_%s;", name, m);
+      api_decl->newline();
+    }
   }
 }
 
@@ -419,6 +707,7 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
 
   // TODO: synthesize boundary
   builder->append_format("// =============== control %s ==============", cbname);
+  emitLiveTypes(bsv, cbtype);
   builder->append_line("interface %s;", cbtype);
   builder->incr_indent();
   builder->append_line("interface PipeIn#(MetadataRequest) prev;");
@@ -427,7 +716,19 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
     auto tname = t.first;
     auto type = CamelCase(tname);
     builder->append_line("method Action %s_add_entry(ConnectalTypes::%sReqT key, ConnectalTypes::%sRspT value);", tname, type, type);
+    if (TableCodeGen::getMatchType(t.second) != "exact") {
+      builder->append_line("method Action %s_add_masked_entry(ConnectalTypes::%sReqT key, ConnectalTypes::%sReqT mask, ConnectalTypes::%sRspT value);", tname, type, type, type);
+    }
+    if (t.second->getKey() == nullptr) continue;
+    if (TableCodeGen::isIndexed(t.second)) {
+      builder->append_line("method Action %s_delete_entry(Bit#(32) index);", tname);
+      builder->append_line("method Action %s_modify_entry(Bit#(32) index, ConnectalTypes::%sRspT value);", tname, type);
+    }
+    builder->append_line("method Action %s_read_entry(Bit#(32) index, Bit#(32) count);", tname);
   }
+  // entry info of all tables, tagged with the table id
+  builder->append_line("interface Get#(Tuple2#(Bit#(8), MatchEntryInfo)) entry_info;");
+  builder->append_line("method Action table_load(Bit#(8) id, Bit#(128) data, Bool commit);");
   builder->append_line("method Action set_verbosity(int verbosity);");
   builder->decr_indent();
   builder->append_line("endinterface");
@@ -435,8 +736,11 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
   builder->incr_indent();
   builder->append_line("`PRINT_DEBUG_MSG");
   emitFifo(bsv);
+  emitRegisters(bsv);
+  builder->append(action_builder.toString());
   emitDeclaration(bsv);
   emitConnection(bsv);
+  emitEntryInfo(bsv);
 
   // emit control flow
   if (cfg != nullptr) {
@@ -446,7 +750,13 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
     for (auto node : cfg->allNodes) {
       if (node->is<CFG::TableNode>()) {
         auto t = node->to<CFG::TableNode>();
-        emitTableRule(bsv, t);
+        auto stage = deps->getStage(t->name);
+        if (stage != nullptr && stage->front() == t) {
+          emitStageRule(bsv, *stage);
+        }
+        if (stage == nullptr || stage->back() == t) {
+          emitTableRule(bsv, t);
+        }
       } else if (node->is<CFG::IfNode>()) {
         auto n = node->to<CFG::IfNode>();
         emitCondRule(bsv, n);
@@ -459,7 +769,31 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
   for (auto t : tables) {
     auto tname = t.first;
     builder->append_line("method %s_add_entry = %s.add_entry;", tname, tname);
+    if (TableCodeGen::getMatchType(t.second) != "exact") {
+      builder->append_line("method %s_add_masked_entry = %s.add_masked_entry;", tname, tname);
+    }
+    if (t.second->getKey() == nullptr) continue;
+    if (TableCodeGen::isIndexed(t.second)) {
+      builder->append_line("method %s_delete_entry = %s.delete_entry;", tname, tname);
+      builder->append_line("method %s_modify_entry = %s.modify_entry;", tname, tname);
+    }
+    builder->append_line("method %s_read_entry = %s.read_entry;", tname, tname);
+  }
+  builder->append_line("interface entry_info = toGet(entry_info_ff);");
+  // bulk load beats, addressed by the TableId of a @shadow table
+  builder->append_line("method Action table_load(Bit#(8) id, Bit#(128) data, Bool commit);");
+  builder->incr_indent();
+  builder->append_line("case (id)");
+  builder->incr_indent();
+  for (auto t : tables) {
+    if (!TableCodeGen::isShadow(t.second)) continue;
+    builder->append_line("%d: %s_shadow.load_beat(data, commit);", tableId(t.first), t.first);
   }
+  builder->append_line("default: noAction;");
+  builder->decr_indent();
+  builder->append_line("endcase");
+  builder->decr_indent();
+  builder->append_line("endmethod");
   builder->append_line("method Action set_verbosity (int verbosity);");
   builder->incr_indent();
   builder->append_line("cf_verbosity <= verbosity;");
@@ -467,6 +801,10 @@ void FPGAControl::emit(BSVProgram & bsv, CppProgram & cpp) {
     auto tname = t.first;
     builder->append_line("%s.set_verbosity(verbosity);", tname);
   }
+  for (auto r : registers) {
+    if (r.second.ports == 0) continue;
+    builder->append_line("reg_%s.set_verbosity(verbosity);", r.second.name);
+  }
   builder->decr_indent();
   builder->append_line("endmethod");
   builder->decr_indent();
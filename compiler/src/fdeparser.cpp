@@ -15,12 +15,26 @@
 */
 
 #include "fdeparser.h"
+#include <algorithm>
 #include "ir/ir.h"
 #include "vector_utils.h"
 #include "string_utils.h"
 
 namespace FPGA {
 
+// emit sequences up to this many headers get a layout per combination of
+// valid headers
+static const size_t kMaxLayoutHeaders = 6;
+
+// A varbit field is emitted at the length it was parsed with, kept next to
+// it in <field>_len, see StructCodeGen.
+static const IR::StructField* varbitField(const IR::BSV::DeparseState* state) {
+  for (auto f : state->fields) {
+    if (f->type->is<IR::Type_Varbits>()) return f;
+  }
+  return nullptr;
+}
+
 class DeparserBuilder : public Inspector {
   public:
     DeparserBuilder(FPGADeparser* deparser, const FPGAProgram* program) :
@@ -82,46 +96,6 @@ bool DeparserBuilder::preorder(const IR::Member* member) {
   return false;
 }
 
-class DeparserRuleVisitor : public Inspector {
-  public:
-    DeparserRuleVisitor(const FPGADeparser* deparser, CodeBuilder* builder, int& num_rules) :
-      builder(builder), num_rules(num_rules) {}
-    bool preorder(const IR::BSV::DeparseState* state) override;
-  private:
-    const FPGAProgram* program;
-    CodeBuilder* builder;
-    int& num_rules;
-};
-
-bool DeparserRuleVisitor::preorder(const IR::BSV::DeparseState* state) {
-  auto width = state->width_bits;
-  auto hdr = state->to<IR::Type_Header>();
-  auto name = hdr->name.name;
-
-  builder->append_line("`COLLECT_RULE(deparse_fsm, joinRules(vec(genDeparseNextRule(w_%s, StateDeparse%s, %d))));", name, CamelCase(name), width);
-  builder->append_line("`COLLECT_RULE(deparse_fsm, joinRules(vec(genDeparseLoadRule(StateDeparse%s, %d))));", CamelCase(name), width);
-  builder->append_line("`COLLECT_RULE(deparse_fsm, joinRules(vec(genDeparseSendRule(StateDeparse%s, %d))));", CamelCase(name), width);
-  num_rules += 3;
-  return false;
-}
-
-class DeparserStateVisitor : public Inspector {
-  public:
-    DeparserStateVisitor(const FPGADeparser* deparser, CodeBuilder* builder) :
-      builder(builder) {}
-    bool preorder(const IR::BSV::DeparseState* state) override;
-  private:
-    const FPGAProgram* program;
-    CodeBuilder* builder;
-};
-
-bool DeparserStateVisitor::preorder(const IR::BSV::DeparseState* state) {
-  auto hdr = state->to<IR::Type_Header>();
-  auto name = hdr->name.name;
-  builder->append_format("PulseWire w_%s <- mkPulseWire();", name);
-  return false;
-}
-
 // Convert emit() to IR::BSV::DeparseState
 bool FPGADeparser::build() {
   auto stat = controlBlock->container->body;
@@ -130,137 +104,114 @@ bool FPGADeparser::build() {
   return true;
 }
 
-void FPGADeparser::emitEnums() {
+void FPGADeparser::emitTypedefs() {
   builder->append_line("`ifdef DEPARSER_STRUCT");
-  builder->append_line("typedef enum {");
-  builder->incr_indent();
-  builder->append_line("StateDeparseStart,");
+  // rg_header of Deparser.bsv holds every header of the emit sequence, and
+  // at least one beat
+  int beat = program->datapathWidth;
+  int width = 0;
   for (auto r : states) {
-    auto name = r->name.name;
-    if (r != states.back()) {
-      builder->append_format("StateDeparse%s,", CamelCase(name));
-    } else {
-      builder->append_format("StateDeparse%s", CamelCase(name));
-    }
+    width += r->width_bits;
   }
-  builder->decr_indent();
-  builder->append_line("} DeparserState deriving (Bits, Eq, FShow);");
+  builder->append_line("typedef %d DeparserBeatBytes;", beat / 8);
+  builder->append_line("typedef %d DeparserHeaderWidth;", std::max(width, beat));
   builder->append_line("`endif  // DEPARSER_STRUCT");
 }
 
-void FPGADeparser::emitRules() {
-  builder->append_line("`ifdef DEPARSER_RULES");
-  // deparse rules are mutually exclusive
-//  std::vector<cstring> exclusive_rules;
-//  for (auto r : states) {
-//    cstring rl = cstring("rl_deparse_") + r->name.toString() + cstring("_next");
-//    exclusive_rules.push_back(rl);
-//  }
-//  auto exclusive_annotation = cstring("(* mutually_exclusive=\"");
-//  for (auto r : exclusive_rules) {
-//    exclusive_annotation += r;
-//    if (r != exclusive_rules.back()) {
-//      exclusive_annotation += cstring(",");
-//    }
-//  }
-//  exclusive_annotation += cstring("\" *)");
-//  builder->append_line(exclusive_annotation);
-
-  int num_rules = 0;
-  DeparserRuleVisitor visitor(this, builder, num_rules);
-  for (auto r : states) {
-    r->apply(visitor);
-  }
-  builder->append_line("Vector#(%d, Rules) fsmRules = toVector(deparse_fsm);", num_rules);
-  builder->append_line("`endif  // DEPARSER_RULES");
-}
-
-void FPGADeparser::emitStates() {
-  builder->append_line("`ifdef DEPARSER_STATE");
-
-  // pulsewire to initiate next state
-  DeparserStateVisitor visitor(this, builder);
-  for (auto r : states) {
-    r->apply(visitor);
-  }
-  builder->append_line("");
-
-  // Function: next_parse_state
-  auto len = states.size();
-  // bit0 is by default 0.
-  auto lenp1 = len + 1;
-  builder->append_format("function Bit#(%d) nextDeparseState(MetadataT metadata);", lenp1);
-  builder->incr_indent();
-  builder->append_format("Vector#(%d, Bool) headerValid;", lenp1);
-  builder->append_line("headerValid[0] = False;");
-  for (int i = 0; i < states.size(); i++) {
-    cstring name = states.at(i)->indexed_name;
-    builder->append_format("headerValid[%d] = checkForward(metadata.hdr.%s);", i+1, name);
-  }
-  builder->append_line("let vec = pack(headerValid);");
-  builder->append_line("return vec;");
-  builder->decr_indent();
-  builder->append_line("endfunction");
-  builder->append_line("");
-
-  // Function: transit_next_state
-  builder->append_line("function Action transit_next_state(MetadataT metadata);");
-  builder->incr_indent();
-  builder->append_line("action");
-  builder->append_line("let vec = nextDeparseState(metadata);");
-  builder->append_line("if (vec == 0) begin");
-  builder->incr_indent();
-  builder->append_line("header_done <= True;");
-  builder->decr_indent();
-  builder->append_line("end");
-  builder->append_line("else begin");
-  builder->incr_indent();
-  auto nextVecLen = ceil(log2(lenp1));
-  builder->append_format("Bit#(%d) nextHeader = truncate(pack(countZerosLSB(vec)%% %d));", nextVecLen, lenp1 );
-  builder->append_line("DeparserState nextState = unpack(nextHeader);");
-  builder->append_line("case (nextState) matches");
-  builder->incr_indent();
-  for (int i = 0; i < states.size(); i++) {
-    auto name = states.at(i)->name.name;
-    builder->append_format("StateDeparse%s: w_%s.send();", CamelCase(name), name);
-  }
-  builder->append_line("default: $display(\"ERROR: unknown states.\");");
-  builder->decr_indent();
-  builder->append_line("endcase");
-  builder->decr_indent();
-  builder->append_line("end");
-  builder->append_line("endaction");
-  builder->decr_indent();
-  builder->append_line("endfunction");
-
-  // Function: update_metadata
-  builder->append_line("function MetadataT update_metadata(DeparserState state);");
-  builder->incr_indent();
-  builder->append_line("let metadata = rg_metadata;");
-  builder->append_line("case (state) matches");
+// Headers forwarded by the pipeline are packed back to back in emit order,
+// first byte in the low bits, so Deparser.bsv writes as many of them per
+// beat as fit. With few enough headers the layout of every combination of
+// valid headers is computed here and the packing is a constant
+// concatenation, otherwise offsets are accumulated in hardware. A header
+// with a varbit field has a length of its own, so its layout is always
+// accumulated; the field is kept first byte on top and zero past its
+// length, which packs it right behind the fixed part.
+void FPGADeparser::emitLayout() {
+  auto num = states.size();
+  bool varbit = false;
+  builder->append_line("function Tuple2#(Bit#(DeparserHeaderWidth), Bit#(16)) deparse_headers(MetadataT metadata);");
   builder->incr_indent();
+  builder->append_line("Bit#(DeparserHeaderWidth) data = 0;");
+  builder->append_line("Bit#(16) len = 0;");
   for (auto s : states) {
     cstring name = s->name.toString();
-    cstring indexed_name = s->indexed_name;
-    builder->append_line("StateDeparse%s :", CamelCase(name));
+    auto f = varbitField(s);
+    if (f == nullptr) {
+      builder->append_format("let hdr_%s = byteSwap(pack(fromMaybe(?, metadata.hdr.%s).hdr));", name, s->indexed_name);
+      continue;
+    }
+    // drop <field>_len from the bottom of the packed header
+    int fixed = s->width_bits - f->type->to<IR::Type_Varbits>()->size;
+    builder->append_format("let h_%s = fromMaybe(?, metadata.hdr.%s).hdr;", name, s->indexed_name);
+    builder->append_format("Bit#(%d) raw_%s = truncate(pack(h_%s) >> 16);", s->width_bits, name, name);
+    builder->append_format("Bit#(16) len_%s = %d + h_%s.%s_len;", name, fixed, name, f->name.toString());
+    builder->append_format("let hdr_%s = byteSwap(raw_%s) & ~('1 << len_%s);", name, name, name);
+    varbit = true;
+  }
+  if (num > 0 && num <= kMaxLayoutHeaders && !varbit) {
+    builder->append_format("Vector#(%d, Bool) headerValid;", num);
+    for (size_t i = 0; i < num; i++) {
+      builder->append_format("headerValid[%d] = checkForward(metadata.hdr.%s);", i, states.at(i)->indexed_name);
+    }
+    builder->append_line("case (pack(headerValid)) matches");
     builder->incr_indent();
-    builder->append_format("metadata.hdr.%s = updateState(metadata.hdr.%s, tagged StructDefines::NotPresent);", indexed_name, indexed_name);
+    for (unsigned valid = 1; valid < (1u << num); valid++) {
+      std::string pattern;
+      std::vector<cstring> fields;
+      int width = 0;
+      for (size_t i = num; i-- > 0; ) {
+        bool v = (valid >> i) & 1;
+        pattern += v ? "1" : "0";
+        if (v) {
+          fields.push_back(cstring("hdr_") + states.at(i)->name.toString());
+          width += states.at(i)->width_bits;
+        }
+      }
+      builder->append_format("%d'b%s: begin", num, pattern);
+      builder->incr_indent();
+      builder->append_format("data = zeroExtend({%s});", join(fields, ", "));
+      builder->append_format("len = %d;", width);
+      builder->decr_indent();
+      builder->append_line("end");
+    }
+    // no header is forwarded, deparse_headers is a function so the arm
+    // must be an assignment rather than noAction
+    builder->append_line("default: begin");
+    builder->incr_indent();
+    builder->append_line("data = 0;");
+    builder->append_line("len = 0;");
+    builder->decr_indent();
+    builder->append_line("end");
     builder->decr_indent();
+    builder->append_line("endcase");
+  } else {
+    for (auto s : states) {
+      builder->append_format("if (checkForward(metadata.hdr.%s)) begin", s->indexed_name);
+      builder->incr_indent();
+      builder->append_format("data = data | (zeroExtend(hdr_%s) << len);", s->name.toString());
+      if (varbitField(s) != nullptr) {
+        builder->append_format("len = len + len_%s;", s->name.toString());
+      } else {
+        builder->append_format("len = len + %d;", s->width_bits);
+      }
+      builder->decr_indent();
+      builder->append_line("end");
+    }
   }
-  builder->decr_indent();
-  builder->append_line("endcase");
-  builder->append_line("return metadata;");
+  builder->append_line("return tuple2(data, len);");
   builder->decr_indent();
   builder->append_line("endfunction");
-  builder->append_line("let initState = StateDeparse%s;", CamelCase(states[0]->name.toString()));
-  builder->append_line("`endif  // DEPARSER_STATE");
+}
 
+void FPGADeparser::emitStates() {
+  builder->append_line("`ifdef DEPARSER_STATE");
+  emitLayout();
+  builder->append_line("`endif  // DEPARSER_STATE");
 }
 
 void FPGADeparser::emit(BSVProgram & bsv) {
   builder = &bsv.getDeparserBuilder();
-  emitEnums();
-  emitRules();
+  emitTypedefs();
   emitStates();
 }
 
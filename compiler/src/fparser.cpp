@@ -17,12 +17,139 @@
 #include "fparser.h"
 #include "fstruct.h"
 #include <algorithm>
+#include <deque>
+#include <functional>
 #include "ir/ir.h"
 #include "string_utils.h"
 #include "vector_utils.h"
 
 namespace FPGA {
 
+// rg_tmp of Parser.bsv holds a full parse step plus one more beat. A minimum
+// size frame is 512 bits, so waiting for the whole step never runs past the
+// end of a packet.
+static int stepLimit(int beat) {
+  return (beat == 128) ? 384 : 512;
+}
+
+static int bufferWidth(int beat) {
+  return stepLimit(beat) + beat;
+}
+
+static const IR::StructField* varbitField(const IR::Type* type) {
+  if (!type->is<IR::Type_Header>()) return nullptr;
+  for (auto f : type->to<IR::Type_Header>()->fields) {
+    if (f->type->is<IR::Type_Varbits>()) return f;
+  }
+  return nullptr;
+}
+
+// bits taken from the parse buffer when the header is extracted, the varbit
+// field, if any, is collected afterwards
+static int fixedWidth(const IR::Type* type) {
+  int width = type->width_bits();
+  auto f = varbitField(type);
+  if (f != nullptr) {
+    width -= f->type->to<IR::Type_Varbits>()->size;
+  }
+  return width;
+}
+
+// states a transition may lead to, in select order, without duplicates
+static std::vector<cstring> nextStates(const IR::ParserState* state) {
+  std::vector<cstring> next;
+  auto select = state->selectExpression;
+  if (select == nullptr) return next;
+  if (select->is<IR::PathExpression>()) {
+    next.push_back(select->toString());
+  } else if (select->is<IR::SelectExpression>()) {
+    for (auto c : select->to<IR::SelectExpression>()->selectCases) {
+      cstring n = c->state->toString();
+      if (std::find(next.begin(), next.end(), n) == next.end()) {
+        next.push_back(n);
+      }
+    }
+  }
+  return next;
+}
+
+// Prints the length argument of a varbit extract as a Bit#(16) expression.
+// Fields of the header being extracted are read from its fixed part, fields
+// of headers extracted in an earlier step from their rg_hdr_* copy.
+class VarbitLenCodeGen : public Inspector {
+ public:
+  explicit VarbitLenCodeGen(cstring header, CodeBuilder* builder) :
+    builder(builder), header(header) {}
+  bool preorder(const IR::Constant* constant) override;
+  bool preorder(const IR::Cast* cast) override;
+  bool preorder(const IR::Operation_Binary* expr) override;
+  bool preorder(const IR::Member* member) override;
+  bool preorder(const IR::Expression* expr) override;
+ private:
+  CodeBuilder* builder;
+  cstring header;
+};
+
+bool VarbitLenCodeGen::preorder(const IR::Constant* constant) {
+  builder->append(std::to_string(constant->asInt()));
+  return false;
+}
+
+bool VarbitLenCodeGen::preorder(const IR::Cast* cast) {
+  visit(cast->expr);
+  return false;
+}
+
+bool VarbitLenCodeGen::preorder(const IR::Operation_Binary* expr) {
+  builder->append("(");
+  visit(expr->left);
+  builder->append(" ");
+  builder->append(expr->getStringOp());
+  builder->append(" ");
+  visit(expr->right);
+  builder->append(")");
+  return false;
+}
+
+bool VarbitLenCodeGen::preorder(const IR::Member* member) {
+  auto hdr = member->expr->to<IR::Member>();
+  if (hdr == nullptr) {
+    ::error("%1%: varbit length must be computed from header fields", member);
+    return false;
+  }
+  cstring name = hdr->member.toString();
+  if (name != header) {
+    name = cstring("rg_hdr_") + name;
+  }
+  builder->append(cstring("zeroExtend(") + name + "." + member->member.toString() + ")");
+  return false;
+}
+
+bool VarbitLenCodeGen::preorder(const IR::Expression* expr) {
+  ::error("%1%: unsupported varbit length expression", expr);
+  return false;
+}
+
+// headers a varbit length expression reads
+class LengthHeaderCollector : public Inspector {
+ public:
+  explicit LengthHeaderCollector(const P4::TypeMap* typeMap) :
+    typeMap(typeMap) {}
+  bool preorder(const IR::Member* member) override;
+  std::map<cstring, cstring> headers;
+ private:
+  const P4::TypeMap* typeMap;
+};
+
+bool LengthHeaderCollector::preorder(const IR::Member* member) {
+  auto hdr = member->expr->to<IR::Member>();
+  if (hdr == nullptr) return false;
+  auto type = typeMap->getType(hdr, true);
+  if (type->is<IR::Type_Header>()) {
+    headers[hdr->member.toString()] = CamelCase(type->to<IR::Type_Header>()->name.toString());
+  }
+  return false;
+}
 
 class SelectStmtCodeGen : public Inspector {
  public:
@@ -145,51 +272,45 @@ bool SelectStmtCodeGen::preorder(const IR::PathExpression* path) {
 class ExtractStmtCodeGen : public Inspector {
  public:
   explicit ExtractStmtCodeGen( const IR::ParserState* state,
-                               const P4::TypeMap* typeMap,
+                               const FPGAParser* parser,
                                CodeBuilder* builder,
                                int& num_rules) :
-    builder(builder), typeMap(typeMap), state(state), num_rules(num_rules) {}
+    builder(builder), parser(parser), state(state), num_rules(num_rules) {}
   bool preorder(const IR::MethodCallExpression* expr) override;
   bool preorder(const IR::SelectCase* cas) override;
   bool preorder(const IR::SelectExpression* expr) override;
   bool preorder(const IR::PathExpression* expr) override;
  private:
   CodeBuilder* builder;
+  const FPGAParser* parser;
   const IR::ParserState* state;
-  const P4::TypeMap* typeMap;
   int& num_rules;
   std::set<cstring> visited;
+  void emitTransition(cstring next_state);
 };
 
-bool ExtractStmtCodeGen::preorder (const IR::SelectCase* cas) {
+// transitions folded into a merged step are resolved in extract_header and
+// need no rule of their own
+void ExtractStmtCodeGen::emitTransition(cstring next_state) {
   cstring this_state = state->name.toString();
-  if (cas->keyset->is<IR::Constant>()) {
-    cstring next_state = cas->state->toString();
-    if (visited.find(this_state + next_state) != visited.end()) {
-      return false;
-    }
-    if (next_state == "accept") {
-      builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genAcceptRule(w_%s_%s))));", this_state, next_state);
-    } else {
-      builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genContRule(w_%s_%s, State%s, valueOf(%sSz)))));", this_state, next_state, CamelCase(next_state), CamelCase(next_state));
-    }
-    visited.insert(this_state + next_state);
-    num_rules++;
-  } else if (cas->keyset->is<IR::DefaultExpression>()) {
-    cstring next_state = cas->state->toString();
-
-    if (visited.find(this_state + next_state) != visited.end()) {
-      return false;
-    }
-
-    if (next_state == "accept") {
-      builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genAcceptRule(w_%s_%s))));", this_state, next_state);
-    } else {
-      builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genContRule(w_%s_%s, State%s, valueOf(%sSz)))));", this_state, next_state, CamelCase(next_state), CamelCase(next_state));
-    }
+  if (visited.find(this_state + next_state) != visited.end()) {
+    return;
+  }
+  if (parser->isInlined(this_state, next_state)) {
+    return;
+  }
+  if (next_state == "accept") {
+    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genAcceptRule(w_%s_%s))));", this_state, next_state);
+  } else {
+    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genContRule(w_%s_%s, State%s, valueOf(%sWinSz)))));", this_state, next_state, CamelCase(next_state), CamelCase(next_state));
+  }
+  visited.insert(this_state + next_state);
+  num_rules++;
+}
 
-    visited.insert(this_state + next_state);
-    num_rules++;
+bool ExtractStmtCodeGen::preorder (const IR::SelectCase* cas) {
+  if (cas->keyset->is<IR::Constant>() || cas->keyset->is<IR::DefaultExpression>()) {
+    emitTransition(cas->state->toString());
   }
   return false;
 }
@@ -202,14 +323,20 @@ bool ExtractStmtCodeGen::preorder (const IR::SelectExpression* expr) {
 }
 
 bool ExtractStmtCodeGen::preorder (const IR::PathExpression* expr) {
+  // a state without extract, i.e. start, never sends its transition wire
   cstring this_state = state->name.toString();
-  //builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genAcceptRule(w_%s_%s))));", this_state, expr->toString());
-  //num_rules++;
+  if (expr != state->selectExpression || parser->stateWidth.at(this_state) == 0) {
+    return false;
+  }
+  emitTransition(expr->toString());
   return false;
 }
 
 bool ExtractStmtCodeGen::preorder (const IR::MethodCallExpression* expr) {
   cstring this_state = state->name.toString();
+  if (!parser->isStepHead(this_state)) {
+    return false;
+  }
   for (auto h: MakeZipRange(*expr->typeArguments, *expr->arguments)) {
     auto typeName = h.get<0>();
     auto instName = h.get<1>();
@@ -218,10 +345,14 @@ bool ExtractStmtCodeGen::preorder (const IR::MethodCallExpression* expr) {
     // if (member->member == "next") {
     //   ::error("must not print next as state");
     // }
-    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genLoadRule(State%s, valueOf(%sSz)))));", CamelCase(this_state), CamelCase(this_state));
+    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genLoadRule(State%s, valueOf(%sWinSz)))));", CamelCase(this_state), CamelCase(this_state));
     num_rules++;
-    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genExtractRule(State%s, valueOf(%sSz)))));", CamelCase(this_state), CamelCase(this_state));
+    builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genExtractRule(State%s, valueOf(%sWinSz)))));", CamelCase(this_state), CamelCase(this_state));
     num_rules++;
+    if (parser->varbits.count(this_state) != 0) {
+      builder->append_line("`COLLECT_RULE(parse_fsm, joinRules(vec(genVarbitRule(State%sVarbit))));", CamelCase(this_state));
+      num_rules++;
+    }
   }
   return false;
 }
@@ -247,7 +378,7 @@ bool ExtractLenCodeGen::preorder (const IR::MethodCallExpression* expr) {
       auto instName = h.get<1>();
       auto header_type = typeMap->getType(typeName, true);
       CHECK_NULL(header_type);
-      int header_width = header_type->width_bits();
+      int header_width = fixedWidth(header_type);
       builder->append_line("typedef %d %sSz;", header_width, CamelCase(state->toString()));
     }
   } else if (expr->method->toString() == "packet.lookahead") {
@@ -258,10 +389,18 @@ bool ExtractLenCodeGen::preorder (const IR::MethodCallExpression* expr) {
 
 class ExtractFuncCodeGen : public Inspector {
  public:
+  // 'offset' is the bit position of this state's header in the data of the
+  // merged step, 'index' numbers the Header#() variables already declared.
+  // With 'varbitDone' the state's varbit field has been collected, 'data'
+  // holds it and 'len' its length, see varbit_done.
   explicit ExtractFuncCodeGen ( const IR::ParserState* state,
-                                const P4::TypeMap* typeMap,
-                                CodeBuilder* builder) :
-    builder(builder), typeMap(typeMap), state(state) {
+                                const FPGAParser* parser,
+                                CodeBuilder* builder,
+                                int offset = 0,
+                                int index = 0,
+                                bool varbitDone = false) :
+    builder(builder), typeMap(parser->typeMap), parser(parser), state(state),
+    offset(offset), index(index), varbitDone(varbitDone) {
       printPath = false;
     }
   bool preorder(const IR::MethodCallExpression* expr) override;
@@ -273,9 +412,14 @@ class ExtractFuncCodeGen : public Inspector {
   CodeBuilder* builder;
   const IR::ParserState* state;
   const P4::TypeMap* typeMap;
+  const FPGAParser* parser;
   std::vector<cstring> match;
   bool printPath;
-  int index = 0;
+  int offset;
+  int index;
+  bool varbitDone;
+  void emitNextState();
+  void emitInlinedState(cstring next_state, int next_offset);
 };
 
 bool ExtractFuncCodeGen::preorder(const IR::ListExpression* expr) {
@@ -299,6 +443,8 @@ bool ExtractFuncCodeGen::preorder(const IR::ListExpression* expr) {
 }
 
 bool ExtractFuncCodeGen::preorder (const IR::AssignmentStatement* stmt) {
+  // already done when the fixed part was extracted
+  if (varbitDone) return false;
   if (stmt->right->is<IR::Member>()) {
     const IR::Member* expr = stmt->right->to<IR::Member>();
     const IR::Member* header = expr->expr->to<IR::Member>();
@@ -392,16 +538,41 @@ bool ExtractFuncCodeGen::preorder (const IR::MethodCallExpression* expr) {
   for (auto h: MakeZipRange(*expr->typeArguments, *expr->arguments)) {
     auto typeName = h.get<0>();
     auto instName = h.get<1>();
-    auto header_type = typeMap->getType(typeName, true);
-    int header_width = header_type->width_bits();
     const IR::Member* member = instName->to<IR::Member>();
     cstring header = member->member.toString();
-    builder->append_line("let %s = extract_%s(truncate(data));", header, typeName->toString());
-    for (auto stmt : state->components) {
-      if (stmt->is<IR::AssignmentStatement>()) {
-        visit(stmt);
+    auto varbit = parser->varbits.find(this_state);
+    if (varbitDone) {
+      builder->append_line("let %s = rg_varbit_%s;", header, header);
+      builder->append_line("%s.%s = byteSwap(truncate(data));", header, varbit->second.field);
+      builder->append_line("%s.%s_len = len;", header, varbit->second.field);
+    } else {
+      if (offset == 0) {
+        builder->append_line("let %s = extract_%s(truncate(data));", header, typeName->toString());
+      } else {
+        builder->append_line("let %s = extract_%s(truncate(data >> %d));", header, typeName->toString(), offset);
+      }
+      for (auto stmt : state->components) {
+        if (stmt->is<IR::AssignmentStatement>()) {
+          visit(stmt);
+        }
+      }
+      if (parser->lengthHeaders.count(header) != 0) {
+        builder->append_line("rg_hdr_%s <= %s;", header, header);
       }
     }
+    if (varbit != parser->varbits.end() && !varbitDone) {
+      // the header is forwarded once its varbit field is collected
+      builder->append_line("rg_varbit_%s <= %s;", header, header);
+      builder->emitIndent();
+      builder->append("Bit#(16) varbit_len = ");
+      VarbitLenCodeGen lenCodeGen(header, builder);
+      varbit->second.length->apply(lenCodeGen);
+      builder->append(";");
+      builder->newline();
+      builder->append_line("start_varbit(State%sVarbit, varbit_len);", CamelCase(this_state));
+      builder->append_format("consumed = %d;", offset + varbit->second.width);
+      return false;
+    }
 
     builder->append_line("Header#(%s) header%d = defaultValue;", CamelCase(typeName->toString()), index);
     builder->append_line("header%d.hdr = %s;", index, header);
@@ -409,12 +580,75 @@ bool ExtractFuncCodeGen::preorder (const IR::MethodCallExpression* expr) {
     builder->append_format("%s_out_ff.enq(tagged Valid header%d);", header, index);
     index++;
   }
+  emitNextState();
+  return false;
+}
+
+// Transitions leaving the merged step go through compute_next_state_* and
+// its pulse wires as before, transitions inside the step extract the next
+// header from the same data in place.
+void ExtractFuncCodeGen::emitNextState() {
+  cstring this_state = state->name.toString();
+  int end = offset + parser->stateWidth.at(this_state);
+  auto select = state->selectExpression;
+  if (select->is<IR::PathExpression>()) {
+    cstring next_state = select->toString();
+    if (parser->isInlined(this_state, next_state)) {
+      emitInlinedState(next_state, end);
+      return;
+    }
+  } else if (select->is<IR::SelectExpression>()) {
+    auto cases = select->to<IR::SelectExpression>()->selectCases;
+    bool merged = false;
+    for (auto c : cases) {
+      merged |= parser->isInlined(this_state, c->state->toString());
+    }
+    if (merged) {
+      builder->append_format("case ({%s}) matches", join(match, ","));
+      builder->incr_indent();
+      for (auto c : cases) {
+        cstring next_state = c->state->toString();
+        if (c->keyset->is<IR::Constant>()) {
+          builder->append_format("%d: begin", c->keyset->toString());
+        } else if (c->keyset->is<IR::DefaultExpression>()) {
+          builder->append_line("default: begin");
+        } else {
+          continue;
+        }
+        builder->incr_indent();
+        if (parser->isInlined(this_state, next_state)) {
+          emitInlinedState(next_state, end);
+        } else {
+          builder->append_line("w_%s_%s.send();", this_state, next_state);
+          builder->append_format("consumed = %d;", end);
+        }
+        builder->decr_indent();
+        builder->append_line("end");
+      }
+      builder->decr_indent();
+      builder->append_line("endcase");
+      return;
+    }
+  }
+  if (!varbitDone) {
+    builder->append_format("consumed = %d;", end);
+  }
   if (match.size() != 0) {
     builder->append_format("compute_next_state_%s(%s);", this_state, join(match, ","));
   } else {
     builder->append_format("compute_next_state_%s();", this_state);
   }
-  return false;
+}
+
+void ExtractFuncCodeGen::emitInlinedState(cstring next_state, int next_offset) {
+  for (auto s : parser->parserBlock->container->states) {
+    if (s->name.toString() == next_state) {
+      ExtractFuncCodeGen extractCodeGen(s, parser, builder, next_offset, index);
+      s->apply(extractCodeGen);
+      return;
+    }
+  }
+  BUG("merged state %1% not found", next_state);
 }
 
 class PulseWireCodeGen : public Inspector {
@@ -570,13 +804,17 @@ void FPGAParser::emitEnums(BSVProgram & bsv) {
   builder->incr_indent();
   std::vector<cstring> state_vec;
   for (auto state: parserBlock->container->states) {
-    state_vec.push_back(state->name.toString());
+    state_vec.push_back(cstring("State") + CamelCase(state->name.toString()));
+  }
+  // collecting the varbit field of a state is a state of its own
+  for (auto v : varbits) {
+    state_vec.push_back(cstring("State") + CamelCase(v.first) + "Varbit");
   }
   for (auto s : state_vec) {
     if (s == state_vec.back())
-      builder->append_format("State%s", CamelCase(s));
+      builder->append_format("%s", s);
     else
-      builder->append_format("State%s,", CamelCase(s));
+      builder->append_format("%s,", s);
   }
   builder->decr_indent();
   builder->append_line("} ParserState deriving (Bits, Eq);");
@@ -721,25 +959,65 @@ void FPGAParser::emit(BSVProgram & bsv) {
     ExtractLenCodeGen extractLenCodeGen(state, typeMap, builder);
     state->apply(extractLenCodeGen);
   }
+  builder->append_line("typedef %d ParserBeatBytes;", program->datapathWidth / 8);
+  builder->append_line("typedef %d ParserBuffWidth;", bufferWidth(program->datapathWidth));
+  builder->append_line("typedef %d VarbitMaxWidth;", varbitWidth);
+  // 0 when the whole packet goes through the parser
+  builder->append_line("typedef %d HeaderVectorBytes;", headerVectorBytes);
+  // bits buffered before a (merged) step is extracted
+  for (auto state: parserBlock->container->states) {
+    cstring this_state = state->name.toString();
+    if (isStepHead(this_state)) {
+      builder->append_line("typedef %d %sWinSz;", mergeWindow.at(this_state), CamelCase(this_state));
+    }
+  }
   builder->append_line("`endif");
 
   builder->append_line("`ifdef PARSER_FUNCTION");
-  builder->append_line("function Action extract_header(ParserState state, Bit#(512) data);");
+  // returns the number of bits consumed, which depends on the path taken
+  // through a merged step
+  builder->append_line("function ActionValue#(Bit#(10)) extract_header(ParserState state, Bit#(%d) data);", bufferWidth(program->datapathWidth));
   builder->incr_indent();
-  builder->append_line("action");
+  builder->append_line("actionvalue");
+  builder->append_line("Bit#(10) consumed = 0;");
   builder->append_line("case (state) matches");
   builder->incr_indent();
   for (auto state: parserBlock->container->states) {
     cstring this_state = state->name.toString();
+    if (!isStepHead(this_state)) continue;
     builder->append_line("State%s : begin", CamelCase(this_state));
     builder->incr_indent();
-    ExtractFuncCodeGen extractCodeGen(state, typeMap, builder);
+    ExtractFuncCodeGen extractCodeGen(state, this, builder);
     state->apply(extractCodeGen);
     builder->decr_indent();
     builder->append_line("end");
   }
   builder->decr_indent();
   builder->append_line("endcase");
+  builder->append_line("return consumed;");
+  builder->append_line("endactionvalue");
+  builder->decr_indent();
+  builder->append_line("endfunction");
+  // forwards a header once genVarbitRule has collected its varbit field,
+  // 'len' bits of it
+  builder->append_line("function Action varbit_done(ParserState state, Bit#(VarbitMaxWidth) data, Bit#(16) len);");
+  builder->incr_indent();
+  builder->append_line("action");
+  builder->append_line("case (state) matches");
+  builder->incr_indent();
+  for (auto state: parserBlock->container->states) {
+    cstring this_state = state->name.toString();
+    if (varbits.count(this_state) == 0) continue;
+    builder->append_line("State%sVarbit : begin", CamelCase(this_state));
+    builder->incr_indent();
+    ExtractFuncCodeGen extractCodeGen(state, this, builder, 0, 0, true);
+    state->apply(extractCodeGen);
+    builder->decr_indent();
+    builder->append_line("end");
+  }
+  builder->append_line("default: noAction;");
+  builder->decr_indent();
+  builder->append_line("endcase");
   builder->append_line("endaction");
   builder->decr_indent();
   builder->append_line("endfunction");
@@ -747,7 +1025,7 @@ void FPGAParser::emit(BSVProgram & bsv) {
 
   builder->append_line("`ifdef PARSER_RULES");
   for (auto state: parserBlock->container->states) {
-    ExtractStmtCodeGen extractCodeGen(state, typeMap, builder, num_rules);
+    ExtractStmtCodeGen extractCodeGen(state, this, builder, num_rules);
     state->apply(extractCodeGen);
   }
   builder->append_line("Vector#(%d, Rules) fsmRules = toVector(parse_fsm);", num_rules);
@@ -776,6 +1054,15 @@ void FPGAParser::emit(BSVProgram & bsv) {
   RegCodeGen visitor(typeMap, builder);
   usermeta->apply(visitor);
 
+  // Register for headers waiting on their varbit field, or read by the
+  // length of one
+  for (auto v : varbits) {
+    builder->append_line("Reg#(%s) rg_varbit_%s <- mkRegU;", v.second.type, v.second.header);
+  }
+  for (auto h : lengthHeaders) {
+    builder->append_line("Reg#(%s) rg_hdr_%s <- mkRegU;", h.second, h.first);
+  }
+
   builder->append_line("`endif");
 }
 
@@ -793,7 +1080,228 @@ bool FPGAParser::build() {
   headers = pl->getParameter(model.parser.headersParam.index);
   userMetadata = pl->getParameter(model.parser.metadataParam.index);
   stdMetadata = pl->getParameter(model.parser.standardMetadataParam.index);
+  collectVarbits();
+  mergeStates();
+  if (program->headerVector != 0) {
+    int depth = maxParseDepth();
+    if (program->headerVector > 0) {
+      headerVectorBytes = program->headerVector;
+      if (depth < 0 || depth > headerVectorBytes * 8) {
+        ::warning("parser may read past the %1% byte header vector", headerVectorBytes);
+      }
+    } else if (depth < 0) {
+      ::warning("parse graph has a loop, header vector mode needs --header-vector <bytes>");
+    } else {
+      headerVectorBytes = (depth + 7) / 8;
+    }
+    LOG1("parser: header vector " << headerVectorBytes << " bytes");
+  }
   return true;
 }
 
+// Bits extracted on the longest path from the start state, including the
+// largest varbit, or -1 if a state can be reached again (header stacks).
+int FPGAParser::maxParseDepth() const {
+  std::map<cstring, const IR::ParserState*> states;
+  for (auto state : parserBlock->container->states) {
+    states[state->name.toString()] = state;
+  }
+  std::map<cstring, int> depth;
+  std::set<cstring> visiting;
+  std::function<int(cstring)> walk = [&](cstring name) {
+    if (states.count(name) == 0) return 0;
+    auto it = depth.find(name);
+    if (it != depth.end()) return it->second;
+    if (!visiting.insert(name).second) return -1;
+    int tail = 0;
+    for (auto next : nextStates(states.at(name))) {
+      int d = walk(next);
+      if (d < 0) return -1;
+      tail = std::max(tail, d);
+    }
+    visiting.erase(name);
+    int self = stateWidth.at(name) + (varbits.count(name) != 0 ? varbitWidth : 0);
+    depth[name] = self + tail;
+    return depth[name];
+  };
+  return walk("start");
+}
+
+bool FPGAParser::isStepHead(cstring state) const {
+  auto it = mergeHead.find(state);
+  return it != mergeHead.end() && it->second == state;
+}
+
+bool FPGAParser::isInlined(cstring from, cstring to) const {
+  return inlined.find(from + "." + to) != inlined.end();
+}
+
+// Find packet.extract(hdr, len) calls. The length is in bits and may only
+// read fields of the header being extracted or of headers extracted before.
+void FPGAParser::collectVarbits() {
+  for (auto state : parserBlock->container->states) {
+    cstring name = state->name.toString();
+    for (auto c : state->components) {
+      if (!c->is<IR::MethodCallStatement>()) continue;
+      auto expr = c->to<IR::MethodCallStatement>()->methodCall;
+      if (expr->method->toString() != "packet.extract" || expr->arguments->size() != 2) continue;
+      auto type = typeMap->getType(expr->typeArguments->at(0), true);
+      auto field = varbitField(type);
+      auto member = expr->arguments->at(0)->to<IR::Member>();
+      if (field == nullptr || member == nullptr || member->member == "next") {
+        ::error("%1%: header stack or header without varbit field extracted with a length", expr);
+        continue;
+      }
+      int size = field->type->to<IR::Type_Varbits>()->size;
+      if (size % 8 != 0) {
+        ::error("%1%: varbit field must be a whole number of bytes", field);
+      }
+      VarbitExtract v;
+      v.header = member->member.toString();
+      v.type = CamelCase(type->to<IR::Type_Header>()->name.toString());
+      v.field = field->name.toString();
+      v.width = fixedWidth(type);
+      v.length = expr->arguments->at(1);
+      varbits[name] = v;
+      varbitWidth = std::max(varbitWidth, size);
+      LengthHeaderCollector collector(typeMap);
+      v.length->apply(collector);
+      for (auto h : collector.headers) {
+        if (h.first != v.header) {
+          lengthHeaders.insert(h);
+        }
+      }
+    }
+  }
+}
+
+// Group parser states into steps that are extracted in one cycle.
+//
+// A state is folded into the step of its predecessor if it has no other
+// predecessor, extracts exactly one fixed-size header not yet extracted in
+// the step and does nothing else, and the select that leads to it has
+// constant keysets and only reads headers extracted earlier in the same
+// step, i.e. bits that are already buffered. Steps are capped at
+// stepLimit() bits.
+
+void FPGAParser::mergeStates() {
+  std::map<cstring, const IR::ParserState*> states;
+  std::map<cstring, int> extracts;
+  std::map<cstring, std::set<cstring>> headersOf;
+  std::map<cstring, int> preds;
+  std::map<cstring, std::vector<cstring>> succs;
+
+  for (auto state : parserBlock->container->states) {
+    cstring name = state->name.toString();
+    states[name] = state;
+    stateWidth[name] = 0;
+    extracts[name] = 0;
+    for (auto c : state->components) {
+      // assignments and other calls are emitted once per state, they are
+      // not merged
+      if (!c->is<IR::MethodCallStatement>()) {
+        extracts[name] = -1;
+        continue;
+      }
+      auto expr = c->to<IR::MethodCallStatement>()->methodCall;
+      cstring method = expr->method->toString();
+      if (method != "packet.extract") {
+        extracts[name] = -1;
+      } else if (extracts[name] >= 0) {
+        for (auto h : MakeZipRange(*expr->typeArguments, *expr->arguments)) {
+          auto header_type = typeMap->getType(h.get<0>(), true);
+          stateWidth[name] += fixedWidth(header_type);
+          // the varbit field is collected after the step
+          if (varbits.count(name) != 0) {
+            extracts[name] = -1;
+            break;
+          }
+          extracts[name]++;
+          // header stacks (hdr.x.next) are not merged
+          auto member = h.get<1>()->to<IR::Member>();
+          if (member == nullptr || member->member == "next") {
+            extracts[name] = -1;
+            break;
+          }
+          headersOf[name].insert(member->member.toString());
+        }
+      }
+    }
+    succs[name] = nextStates(state);
+  }
+  for (auto s : succs) {
+    for (auto next : s.second) {
+      preds[next]++;
+    }
+  }
+
+  // true if the select of 'state' only reads headers in 'buffered' and
+  // only has constant or default keysets
+  auto selectBuffered = [&](cstring state, const std::set<cstring>& buffered) {
+    auto select = states.at(state)->selectExpression;
+    if (select == nullptr || !select->is<IR::SelectExpression>()) return true;
+    for (auto k : select->to<IR::SelectExpression>()->select->components) {
+      auto member = k->to<IR::Member>();
+      if (member == nullptr) return false;
+      auto header = member->expr->to<IR::Member>();
+      if (header == nullptr || buffered.count(header->member.toString()) == 0) return false;
+    }
+    for (auto c : select->to<IR::SelectExpression>()->selectCases) {
+      if (!c->keyset->is<IR::Constant>() && !c->keyset->is<IR::DefaultExpression>()) return false;
+    }
+    return true;
+  };
+
+  // true if 'state' extracts a header already extracted in the step
+  auto extractsAgain = [&](cstring state, const std::set<cstring>& buffered) {
+    for (auto h : headersOf[state]) {
+      if (buffered.count(h) != 0) return true;
+    }
+    return false;
+  };
+
+  // exits of a step become the heads of the steps that follow it
+  std::deque<cstring> pending;
+  std::function<void(cstring, cstring, int, std::set<cstring>)> grow =
+      [&](cstring head, cstring state, int end, std::set<cstring> buffered) {
+    mergeWindow[head] = std::max(mergeWindow[head], end);
+    bool mergeable = extracts.at(state) == 1;
+    if (mergeable) {
+      buffered.insert(headersOf[state].begin(), headersOf[state].end());
+      mergeable = selectBuffered(state, buffered);
+    }
+    for (auto next : succs[state]) {
+      if (!mergeable || states.count(next) == 0 || mergeHead.count(next) != 0 ||
+          preds[next] != 1 || extracts.at(next) != 1 || extractsAgain(next, buffered) ||
+          end + stateWidth.at(next) > stepLimit(program->datapathWidth)) {
+        pending.push_back(next);
+        continue;
+      }
+      mergeHead[next] = head;
+      inlined.insert(state + "." + next);
+      LOG1("parser: merge " << next << " into " << head);
+      grow(head, next, end + stateWidth.at(next), buffered);
+    }
+  };
+
+  // walk from the entry state so that a state is considered for merging
+  // before its successors, then pick up unreachable states
+  std::vector<cstring> entries;
+  entries.push_back("start");
+  for (auto state : parserBlock->container->states) {
+    entries.push_back(state->name.toString());
+  }
+  for (auto entry : entries) {
+    pending.push_back(entry);
+    while (!pending.empty()) {
+      cstring head = pending.front();
+      pending.pop_front();
+      if (states.count(head) == 0 || mergeHead.count(head) != 0) continue;
+      mergeHead[head] = head;
+      mergeWindow[head] = stateWidth.at(head);
+      grow(head, head, stateWidth.at(head), std::set<cstring>());
+    }
+  }
+}
+
 }  // namespace FPGA
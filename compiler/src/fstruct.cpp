@@ -35,8 +35,22 @@ bool StructCodeGen::preorder(const IR::Type_Header* hdr) {
   builder->append_line("typedef struct {");
   builder->incr_indent();
   int header_width = 0;
+  int varbit_width = 0;
   for (auto f : hdr->fields) {
-    if (f->type->is<IR::Type_Bits>()) {
+    if (f->type->is<IR::Type_Varbits>()) {
+      // filled in by the parser once the length is known, see genVarbitRule,
+      // first byte on top. The deparser emits the parsed length in bits.
+      varbit_width = f->type->to<IR::Type_Varbits>()->size;
+      if (f != hdr->fields.at(hdr->fields.size() - 1)) {
+        ::error("%1%: varbit field must be the last field of the header", f);
+      }
+      cstring len = f->name.toString() + "_len";
+      if (hdr->getField(len) != nullptr) {
+        ::error("%1%: field name is taken by the length of varbit field %2%", hdr->getField(len), f);
+      }
+      builder->append_line("Bit#(%d) %s;", varbit_width, f->name.toString());
+      builder->append_line("Bit#(16) %s;", len);
+    } else if (f->type->is<IR::Type_Bits>()) {
       int size = f->type->to<IR::Type_Bits>()->size;
       cstring name = f->name.toString();
       if (size > 64) {
@@ -56,7 +70,13 @@ bool StructCodeGen::preorder(const IR::Type_Header* hdr) {
   builder->append_format("} %s deriving (Bits, Eq, FShow);", header_type);
   builder->append_format("function %s extract_%s(Bit#(%d) data);", header_type, name, header_width);
   builder->incr_indent();
-  builder->append_line("return unpack(byteSwap(data));");
+  if (varbit_width != 0) {
+    builder->append_line("Bit#(%d) varbit = 0;", varbit_width);
+    builder->append_line("Bit#(16) varbit_len = 0;");
+    builder->append_line("return unpack({byteSwap(data), varbit, varbit_len});");
+  } else {
+    builder->append_line("return unpack(byteSwap(data));");
+  }
   builder->decr_indent();
   builder->append_line("endfunction");
   return false;
@@ -0,0 +1,147 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <cstring>
+#include "liveness.h"
+#include "fcontrol.h"
+
+namespace FPGA {
+
+cstring MetadataLiveness::metaPrefix() const {
+  auto params = control->controlBlock->container->type->applyParams;
+  auto index = control->program->v1model.ingress.metadataParam.index;
+  return params->getParameter(index)->name.toString() + ".";
+}
+
+// hdr.ethernet.dstAddr used as a key is the Metadata member dstAddr, and
+// meta.ingress_metadata.bd is part of the member ingress_metadata
+cstring MetadataLiveness::toMember(const FieldAccess& access) const {
+  if (access.field != nullptr) {
+    auto name = nameFromAnnotation(access.field->annotations, access.field->name);
+    if (members.count(name) != 0) return name;
+  }
+  cstring prefix = metaPrefix();
+  if (strncmp(access.path.c_str(), prefix.c_str(), prefix.size()) != 0) {
+    return nullptr;
+  }
+  std::string rest(access.path.c_str() + prefix.size());
+  cstring name = rest.substr(0, rest.find('.'));
+  if (members.count(name) != 0) return name;
+  return nullptr;
+}
+
+void MetadataLiveness::collect(const CFG::Node* node) {
+  auto& use = uses[node];
+  auto& def = defs[node];
+  if (node->is<CFG::IfNode>()) {
+    FieldAccessCollector collector(control);
+    node->to<CFG::IfNode>()->statement->condition->apply(collector);
+    for (auto r : collector.reads) {
+      cstring m = toMember(r);
+      if (m != nullptr) use.insert(m);
+    }
+  } else if (node->is<CFG::TableNode>()) {
+    auto table = node->to<CFG::TableNode>()->table;
+    auto keys = table->getKey();
+    if (keys != nullptr) {
+      FieldAccessCollector collector(control);
+      for (auto key : keys->keyElements) {
+        cstring m = toMember(collector.toAccess(key->expression));
+        if (m != nullptr) use.insert(m);
+      }
+    }
+    // a member is overwritten only if every action writes it
+    bool first = true;
+    for (auto a : table->getActionList()->actionList) {
+      auto decl = control->refMap->getDeclaration(a->getPath(), true);
+      std::set<cstring> written;
+      if (decl->is<IR::P4Action>()) {
+        FieldAccessCollector collector(control);
+        decl->to<IR::P4Action>()->body->apply(collector);
+        for (auto r : collector.reads) {
+          cstring m = toMember(r);
+          if (m != nullptr) use.insert(m);
+        }
+        // writing one field of a struct member, or the header a member
+        // is copied from, does not replace the member
+        for (auto w : collector.writes) {
+          cstring m = toMember(w);
+          if (m != nullptr && w.path == metaPrefix() + m) written.insert(m);
+        }
+      }
+      if (first) {
+        def = written;
+        first = false;
+      } else {
+        std::set<cstring> both;
+        for (auto m : def) {
+          if (written.count(m) != 0) both.insert(m);
+        }
+        def = both;
+      }
+    }
+  }
+}
+
+void MetadataLiveness::build(const std::set<cstring>& liveAtExit) {
+  for (auto m : control->program->metadataMembers()) {
+    members.insert(m.first);
+  }
+  if (control->cfg == nullptr) return;
+  for (auto node : control->cfg->allNodes) {
+    collect(node);
+    live_in[node];
+    live_out[node];
+  }
+  if (control->cfg->exitPoint != nullptr) {
+    live_in[control->cfg->exitPoint] = liveAtExit;
+    live_out[control->cfg->exitPoint] = liveAtExit;
+  }
+
+  // backward dataflow, iterate until no set grows
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto node : control->cfg->allNodes) {
+      if (node == control->cfg->exitPoint) continue;
+      std::set<cstring> out;
+      for (auto e : node->successors.edges) {
+        auto& in = live_in[e->endpoint];
+        out.insert(in.begin(), in.end());
+      }
+      std::set<cstring> in = uses[node];
+      for (auto m : out) {
+        if (defs[node].count(m) == 0) in.insert(m);
+      }
+      if (out != live_out[node] || in != live_in[node]) {
+        live_out[node] = out;
+        live_in[node] = in;
+        changed = true;
+      }
+    }
+  }
+  for (auto node : control->cfg->allNodes) {
+    LOG1("live into " << node->name << ": " << live_in[node].size() << " of " << members.size());
+  }
+}
+
+const std::set<cstring>& MetadataLiveness::liveAtEntry() const {
+  if (control->cfg == nullptr || control->cfg->entryPoint == nullptr) return members;
+  return live_in.at(control->cfg->entryPoint);
+}
+
+}  // namespace FPGA
@@ -18,6 +18,7 @@
 #include "midend/expandLookahead.h"
 #include "midend/tableHit.h"
 #include "frontends/p4/simplifyParsers.h"
+#include "frontends/p4/createBuiltins.h"
 #include "frontends/p4/typeMap.h"
 #include "frontends/p4/evaluator/evaluator.h"
 #include "frontends/p4/typeChecking/typeChecker.h"
@@ -130,4 +131,22 @@ const IR::P4Program* MidEnd::run(const FPGAOptions& options, const IR::P4Program
     return program;
 }
 
+const IR::P4Program* MidEnd::load(const FPGAOptions& options, const IR::P4Program* program) {
+    if (program == nullptr)
+        return nullptr;
+
+    PassManager load = {
+        new P4::CreateBuiltins(),
+        new P4::ResolveReferences(&refMap, true),
+        new P4::TypeInference(&refMap, &typeMap, false),
+    };
+    load.setName("LoadMidEnd");
+    load.addDebugHooks(hooks);
+    program = program->apply(load);
+    if (::errorCount() > 0)
+        return nullptr;
+
+    return program;
+}
+
 } // namespace FPGA
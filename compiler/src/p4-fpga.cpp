@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <unistd.h>
 #include <string>
 #include <iostream>
 
@@ -11,42 +12,111 @@
 #include "midend.h"
 #include "foptions.h"
 #include "backend.h"
+#include "cache.h"
 #include "partition.h"
-//#include "profile.h"
+#include "profile.h"
+#include "table.h"
+#include "timer.h"
 #include "frontends/common/parseInput.h"
 #include "frontends/p4/frontend.h"
 #include "frontends/p4/evaluator/evaluator.h"
 #include "frontends/p4/simplify.h"
 
-// generate bsv
-void compile(FPGAOptions& options, const IR::P4Program* program) {
-    auto hook = options.getDebugHook();
+// command line of this run, used to start it again without the cache
+static char *const *cmdline = nullptr;
 
-    P4::FrontEnd frontend;
-    frontend.addDebugHook(hook);
-    auto pf = frontend.run(options, program);
-    if (::errorCount() > 0)
+// an entry that does not load is removed and the same command is run
+// again, it then misses the cache and compiles the program from source
+static void recompile(const FPGA::MidEndCache* cache) {
+    if (!cache->remove()) {
+        ::error("could not remove unusable mid-end cache entry %1%", cache->getPath());
         exit(1);
+    }
+    ::warning("unusable mid-end cache entry %1% removed, compiling without it",
+              cache->getPath());
+    std::cerr.flush();
+    execv("/proc/self/exe", cmdline);
+    ::error("could not restart the compiler without the mid-end cache");
+    exit(1);
+}
+
+// generate bsv
+void compile(FPGAOptions& options, const IR::P4Program* program,
+             const FPGA::MidEndCache* cache, bool cached) {
+    auto hook = options.getDebugHook();
 
     FPGA::MidEnd midend;
     midend.addDebugHook(hook);
-    pf = midend.run(options, pf);
-    if (::errorCount() > 0)
-        exit(1);
+    const IR::P4Program* pf = nullptr;
+    if (cached) {
+      FPGA::PassTimer timer("midend.cached");
+      pf = midend.load(options, program);
+      if (::errorCount() > 0)
+        recompile(cache);
+    } else {
+      P4::FrontEnd frontend;
+      frontend.addDebugHook(hook);
+      {
+        FPGA::PassTimer timer("frontend");
+        pf = frontend.run(options, program);
+      }
+      if (::errorCount() > 0)
+          exit(1);
+
+      {
+        FPGA::PassTimer timer("midend");
+        pf = midend.run(options, pf);
+      }
+      if (::errorCount() > 0)
+          exit(1);
+      if (cache != nullptr)
+        cache->store(pf);
+    }
+
+    // pass: collect table statistics
+    FPGA::Profiler* profgen = nullptr;
+    if (options.dumpTable || options.report == "json") {
+      profgen = new FPGA::Profiler();
+      PassManager profile = {
+        new P4::ResourceEstimation(&midend.refMap, &midend.typeMap, profgen),
+      };
+      profile.setName("Profile");
+      profile.addDebugHook(hook);
+      FPGA::PassTimer timer("profile");
+      pf = pf->apply(profile);
+      if (options.dumpTable) {
+        FPGA::generate_table_profile(options, profgen);
+      }
+    }
 
     // TODO: why do we need an evaluator pass?
     auto evaluator = new P4::EvaluatorPass(&midend.refMap, &midend.typeMap);
     PassManager backend = {
       evaluator
     };
-    pf->apply(backend);
+    {
+      FPGA::PassTimer timer("evaluator");
+      pf->apply(backend);
+    }
     auto toplevel = evaluator->getToplevelBlock();
 
-    FPGA::run_fpga_backend(options, toplevel, &midend.refMap, &midend.typeMap);
+    FPGA::PassTimer timer("backend");
+    FPGA::run_fpga_backend(options, toplevel, &midend.refMap, &midend.typeMap, profgen);
+}
+
+// cost of a table in BRAM36, same model as the table code generator
+static int table_cost(const FPGA::TableProfile& t) {
+    return FPGA::TableCodeGen::getTableSizing(t.memory, t.shadow, t.size,
+                                              t.key_width, t.action_width).bram;
 }
 
 // partition p4 control flow
 void partition(FPGAOptions& options, const IR::P4Program* program) {
+    // each partition is written to a directory of its own below -o
+    if (options.outputFile.isNullOrEmpty()) {
+        ::error("partitioning needs an output directory, use -o");
+        exit(1);
+    }
     auto hook = options.getDebugHook();
     P4::FrontEnd frontend;
     frontend.addDebugHook(hook);
@@ -61,51 +131,125 @@ void partition(FPGAOptions& options, const IR::P4Program* program) {
         exit(1);
 
     // pass: collect table statistics
-    // auto profgen = new FPGA::Profiler();
-    // PassManager profile = {
-    //   new P4::ResourceEstimation(&midend.refMap, &midend.typeMap, profgen),
-    // };
-    // profile.setName("Profile");
-    // profile.addDebugHook(hook);
-    // pf = pf->apply(profile);
-    // FPGA::generate_table_profile(options, profgen);
+    auto profgen = new FPGA::Profiler();
+    auto order = new P4::CollectTableOrder(&midend.refMap, &midend.typeMap);
+    PassManager profile = {
+      new P4::ResourceEstimation(&midend.refMap, &midend.typeMap, profgen),
+      order,
+    };
+    profile.setName("Profile");
+    profile.addDebugHook(hook);
+    pf = pf->apply(profile);
+    FPGA::generate_table_profile(options, profgen);
+
+    // pass: pick partition boundaries, in number of tables applied
+    std::vector<int> tends;
+    if (options.autoPartition) {
+      std::vector<int> cost;
+      for (auto t : order->tables) {
+        cost.push_back(table_cost(profgen->getTables()[t]));
+      }
+      tends = P4::balancePartitions(cost, options.numPartitions);
+    } else {
+      for (auto np : options.partitions) {
+        tends.push_back(std::stoi(np.c_str(), nullptr, 10));
+      }
+    }
 
     // pass: partition tables
-    // int tbegin = 0;
-    // int tend = 0;
-    // for (auto np : options.partitions) {
-    //   tend = std::stoi(np.c_str(), nullptr, 10);
-    //   PassManager backend = {
-    //     new P4::Partition(&midend.refMap, &midend.typeMap, tbegin, tend),
-    //     new P4::SimplifyControlFlow(&midend.refMap, &midend.typeMap),
-    //   };
-    //   backend.setName("Partition");
-    //   backend.addDebugHook(hook);
-    //   auto p = pf->apply(backend);
-    //   FPGA::generate_partition(options, p, np);
-    //   tbegin = tend;
-    // }
+    auto partgen = new FPGA::Partitioner();
+    int tbegin = 0;
+    int idx = 0;
+    for (auto tend : tends) {
+      auto np = Util::toString(idx);
+      PassManager backend = {
+        new P4::Partition(&midend.refMap, &midend.typeMap, tbegin, tend),
+        new P4::SimplifyControlFlow(&midend.refMap, &midend.typeMap),
+      };
+      backend.setName("Partition");
+      backend.addDebugHook(hook);
+      auto p = pf->apply(backend);
+      FPGA::generate_partition(options, p, np);
+
+      // metadata is lost between pipelines, the previous partition must
+      // serialize every field this one references
+      P4::CollectMetadataFields fields(&midend.typeMap);
+      p->apply(fields);
+      if (idx > 0) {
+        FPGA::generate_partition_metadata(options, fields.fields, np);
+      }
+
+      int cost = 0;
+      partgen->getPartitioner().appendFormat("%d", idx);
+      for (int i = tbegin; i < tend && i < static_cast<int>(order->tables.size()); i++) {
+        cost += table_cost(profgen->getTables()[order->tables[i]]);
+        partgen->getPartitioner().appendFormat(" %s", order->tables[i].c_str());
+      }
+      partgen->getPartitioner().appendFormat(" : %d BRAM36, %d metadata fields", cost,
+                                             static_cast<int>(fields.fields.size()));
+      partgen->getPartitioner().newline();
+
+      // bsv for this partition goes to its own directory
+      auto evaluator = new P4::EvaluatorPass(&midend.refMap, &midend.typeMap);
+      PassManager evaluate = {
+        evaluator
+      };
+      p->apply(evaluate);
+      FPGAOptions popts = options;
+      popts.outputFile = options.outputFile + cstring("/p") + np;
+      FPGA::run_fpga_backend(popts, evaluator->getToplevelBlock(), &midend.refMap, &midend.typeMap);
+
+      tbegin = tend;
+      idx++;
+    }
+    FPGA::generate_partition_report(options, partgen);
 }
 
 int main(int argc, char *const argv[]) {
     setup_gc_logging();
     setup_signals();
+    cmdline = argv;
 
     FPGAOptions options;
     if (options.process(argc, argv) != nullptr)
         options.setInputFile();
     if (::errorCount() > 0)
         exit(1);
+    FPGA::PassTimer::enabled = options.timePasses;
+
+    bool partitioned = options.autoPartition || !options.partitions.empty();
+
+    // unchanged program: parse the cached mid-end output instead
+    FPGA::MidEndCache* cache = nullptr;
+    bool cached = false;
+    if (!options.cacheDir.isNullOrEmpty() && !partitioned) {
+        cache = new FPGA::MidEndCache(options);
+        if (cache->lookup()) {
+            options.file = cache->getPath();
+            options.langVersion = CompilerOptions::FrontendVersion::P4_16;
+            cached = true;
+        }
+    }
 
     // NOTE: reason that we do parseP4File here is because
     // parseP4File() cannot be called twice in current impl
-    auto program = P4::parseP4File(options);
-    if (::errorCount() > 0)
+    const IR::P4Program* program = nullptr;
+    {
+        FPGA::PassTimer timer("parse");
+        program = P4::parseP4File(options);
+    }
+    if (::errorCount() > 0) {
+        if (cached)
+            recompile(cache);
         exit(1);
-
-    compile(options, program);
-
-    //partition(options, program);
+    }
+
+    if (partitioned) {
+        partition(options, program);
+    } else {
+        compile(options, program, cache, cached);
+    }
+    FPGA::PassTimer::report(std::cerr);
 
     return ::errorCount() > 0;
 }
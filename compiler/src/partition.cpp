@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <limits>
 #include "partition.h"
 
 namespace P4 {
@@ -61,21 +63,11 @@ const IR::Node* DoPartition::postorder(IR::BlockStatement* statement) {
 }
 
 const IR::Node* DoPartition::preorder(IR::MethodCallStatement* statement) {
-  auto parent = getContext()->node;
-  if (parent->is<IR::BlockStatement>()) {
-    // calling from another control block, do not increment table count;
+  if (start_partition) {
+    // Do not increment table count on call to control blocks or externs
     auto mi = P4::MethodInstance::resolve(statement, refMap, typeMap);
-    if (start_partition) {
-      // MethodCall on P4Table
-      if (mi->object->is<IR::P4Table>()) {
-        n_table ++;
-      } else {
-        // Do not increment table count on call to control blocks
-      }
-    }
-  } else {
-    if (start_partition) {
-      n_table ++ ;
+    if (mi->is<P4::ApplyMethod>() && mi->object->is<IR::P4Table>()) {
+      n_table ++;
     }
   }
   return statement;
@@ -92,4 +84,85 @@ const IR::Node* DoPartition::postorder(IR::MethodCallStatement* statement) {
   return statement;
 }
 
+bool CollectTableOrder::preorder(const IR::P4Control* control) {
+  if (control->name == "ingress" || control->name == "egress") {
+    visit(control->body);
+  }
+  return false;
+}
+
+bool CollectTableOrder::preorder(const IR::MethodCallStatement* statement) {
+  auto mi = P4::MethodInstance::resolve(statement, refMap, typeMap);
+  if (mi->is<P4::ApplyMethod>() && mi->object->is<IR::P4Table>()) {
+    tables.push_back(mi->object->to<IR::P4Table>()->name);
+  }
+  return false;
+}
+
+bool CollectMetadataFields::preorder(const IR::P4Control* control) {
+  if (control->name == "ingress" || control->name == "egress") {
+    // (headers, metadata, standard_metadata) in v1model
+    auto params = control->type->applyParams;
+    metaParam = params->getParameter(1)->name;
+    standardParam = params->getParameter(2)->name;
+    visit(control->body);
+    visit(control->controlLocals);
+  }
+  return false;
+}
+
+bool CollectMetadataFields::preorder(const IR::Member* member) {
+  auto type = typeMap->getType(member->expr);
+  if (type == nullptr || !type->is<IR::Type_Struct>()) return true;
+  auto field = typeMap->getType(member);
+  if (field == nullptr || !field->is<IR::Type_Bits>()) return false;
+  // headers travel in the packet and locals stay in their pipeline
+  cstring path = member->member.toString();
+  const IR::Expression* e = member->expr;
+  while (e->is<IR::Member>()) {
+    path = e->to<IR::Member>()->member.toString() + cstring(".") + path;
+    e = e->to<IR::Member>()->expr;
+  }
+  if (!e->is<IR::PathExpression>()) return false;
+  auto root = e->to<IR::PathExpression>()->path->name.toString();
+  if (root == metaParam) {
+    fields[cstring("meta.") + path] = field->to<IR::Type_Bits>()->size;
+  } else if (root == standardParam) {
+    fields[cstring("standard_metadata.") + path] = field->to<IR::Type_Bits>()->size;
+  }
+  return false;
+}
+
+std::vector<int> balancePartitions(const std::vector<int>& cost, int n) {
+  int m = cost.size();
+  n = std::max(1, std::min(n, m));
+  std::vector<int> prefix(m + 1, 0);
+  for (int i = 0; i < m; i++) {
+    prefix[i + 1] = prefix[i] + cost[i];
+  }
+  // best[k][i]: smallest max cost splitting the first i tables k ways
+  const int inf = std::numeric_limits<int>::max();
+  std::vector<std::vector<int>> best(n + 1, std::vector<int>(m + 1, inf));
+  std::vector<std::vector<int>> cut(n + 1, std::vector<int>(m + 1, 0));
+  best[0][0] = 0;
+  for (int k = 1; k <= n; k++) {
+    for (int i = k; i <= m; i++) {
+      for (int j = k - 1; j < i; j++) {
+        if (best[k - 1][j] == inf) continue;
+        int c = std::max(best[k - 1][j], prefix[i] - prefix[j]);
+        if (c < best[k][i]) {
+          best[k][i] = c;
+          cut[k][i] = j;
+        }
+      }
+    }
+  }
+  std::vector<int> tend(n);
+  for (int k = n, i = m; k > 0; k--) {
+    tend[k - 1] = i;
+    i = cut[k][i];
+  }
+  return tend;
+}
+
 }  // namespace P4
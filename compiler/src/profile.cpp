@@ -1,4 +1,6 @@
+#include <algorithm>
 #include "profile.h"
+#include "table.h"
 
 namespace P4 {
 
@@ -31,15 +33,33 @@ bool DoResourceEstimation::preorder(const IR::P4Table* table) {
   // pretty print to file
   profgen->getTableProfiler().appendFormat("%d %d %s %s", size_, width_bit, table_type, table->name.toString());
   profgen->getTableProfiler().newline();
+  cstring memory = FPGA::TableCodeGen::getTableMemory(table, FPGA::TableCodeGen::getMatchType(table));
+  profgen->getTables()[table->name] = {table->name, table_type, size_, key_width, action_width,
+                                       memory, FPGA::TableCodeGen::isShadow(table)};
 
   // reset temporary variables
   width_bit = 0;
+  key_width = 0;
+  action_width = 0;
   table_type = "exact";
   return false;
 }
 
 bool DoResourceEstimation::preorder(const IR::ActionList* action) {
   width_bit += std::ceil(log2f(action->actionList.size()));
+  // the parameters that make up the RspT of the generated table
+  std::map<cstring, const IR::Type_Bits*> params_;
+  for (auto a : action->actionList) {
+    auto decl = refMap->getDeclaration(a->getPath(), true);
+    if (!decl->is<IR::P4Action>()) continue;
+    for (auto p : decl->to<IR::P4Action>()->parameters->parameters) {
+      auto t = p->type->to<IR::Type_Bits>();
+      if (t != nullptr) {
+        params_[p->name.toString()] = t;
+      }
+    }
+  }
+  action_width = FPGA::TableCodeGen::getActionWidth(action->actionList.size(), params_);
   return false;
 }
 
@@ -67,6 +87,7 @@ bool DoResourceEstimation::preorder(const IR::Key* key) {
 
   table_type = type_;
   width_bit += width_;
+  key_width = width_;
   return false;
 }
 
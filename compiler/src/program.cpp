@@ -20,6 +20,9 @@ limitations under the License.
 #include "fparser.h"
 #include "fcontrol.h"
 #include "fdeparser.h"
+#include "liveness.h"
+#include "string_utils.h"
+#include "timer.h"
 
 namespace FPGA {
 bool FPGAProgram::build() {
@@ -37,7 +40,10 @@ bool FPGAProgram::build() {
   BUG_CHECK(pb != nullptr, "No parser block found");
   CHECK_NULL(typeMap);
   parser = new FPGAParser(this, pb, typeMap, refMap);
-  success = parser->build();
+  {
+    PassTimer timer("build.parser");
+    success = parser->build();
+  }
   if (!success)
       return success;
 
@@ -47,7 +53,10 @@ bool FPGAProgram::build() {
   BUG_CHECK(cb != nullptr, "No control block found");
   // control block
   ingress = new FPGAControl(this, cb, typeMap, refMap);
-  success = ingress->build();
+  {
+    PassTimer timer("build.control");
+    success = ingress->build();
+  }
   if (!success)
       return success;
 
@@ -56,16 +65,32 @@ bool FPGAProgram::build() {
                 ->to<IR::ControlBlock>();
   BUG_CHECK(eb != nullptr, "No egress block found");
   egress = new FPGAControl(this, eb, typeMap, refMap);
-  success = egress->build();
+  {
+    PassTimer timer("build.control");
+    success = egress->build();
+  }
   if (!success)
     return success;
 
+  // egress first, ingress must carry what egress reads at its entry
+  LOG1("Building Metadata Liveness");
+  {
+    PassTimer timer("build.liveness");
+    egress->liveness = new MetadataLiveness(egress);
+    egress->liveness->build(std::set<cstring>());
+    ingress->liveness = new MetadataLiveness(ingress);
+    ingress->liveness->build(egress->liveness->liveAtEntry());
+  }
+
   LOG1("Building Deparser");
   auto db = pack->getParameterValue(v1model.sw.deparser.name)
                 ->to<IR::ControlBlock>();
   BUG_CHECK(db != nullptr, "No deparser block found");
   deparser = new FPGADeparser(this, db);
-  success = deparser->build();
+  {
+    PassTimer timer("build.deparser");
+    success = deparser->build();
+  }
   if (!success)
     return success;
 
@@ -110,19 +135,21 @@ void FPGAProgram::emitBuiltinMetadata(CodeBuilder* builder) {
   builder->append_line("endinstance");
 
 }
-void FPGAProgram::emitMetadata(CodeBuilder* builder) {
-  builder->append_line("typedef struct {");
-  builder->incr_indent();
+std::vector<std::pair<cstring, cstring>> FPGAProgram::metadataMembers() const {
+  std::vector<std::pair<cstring, cstring>> members;
+  std::set<cstring> names;
+  auto add = [&](cstring name, cstring type) {
+    if (names.insert(name).second) {
+      members.push_back(std::make_pair(name, type));
+    }
+  };
   // implicit metadata in table.
-  for (auto p : ingress->metadata_to_table) {
-    auto name = nameFromAnnotation(p.first->annotations, p.first->name);
-    auto size = p.first->type->to<IR::Type_Bits>()->size;
-    builder->append_line("Maybe#(Bit#(%d)) %s;", size, name);
-  }
-  for (auto p : egress->metadata_to_table) {
-    auto name = nameFromAnnotation(p.first->annotations, p.first->name);
-    auto size = p.first->type->to<IR::Type_Bits>()->size;
-    builder->append_line("Maybe#(Bit#(%d)) %s;", size, name);
+  for (auto control : {ingress, egress}) {
+    for (auto p : control->metadata_to_table) {
+      auto name = nameFromAnnotation(p.first->annotations, p.first->name);
+      auto size = p.first->type->to<IR::Type_Bits>()->size;
+      add(name, cstring("Maybe#(Bit#(") + std::to_string(size) + "))");
+    }
   }
 
   // FIXME: place into Metadata?
@@ -138,9 +165,18 @@ void FPGAProgram::emitMetadata(CodeBuilder* builder) {
     auto name = h->name.toString();
     if (type->is<IR::Type_Struct>()) {
       const IR::Type_Struct* ty = type->to<IR::Type_Struct>();
-      builder->append_format("Maybe#(%s) %s;", CamelCase(ty->name.toString()), name);
+      add(name, cstring("Maybe#(") + CamelCase(ty->name.toString()) + ")");
     }
   }
+  return members;
+}
+
+void FPGAProgram::emitMetadata(CodeBuilder* builder) {
+  builder->append_line("typedef struct {");
+  builder->incr_indent();
+  for (auto m : metadataMembers()) {
+    builder->append_line("%s %s;", m.second, m.first);
+  }
   builder->decr_indent();
   builder->append_line("} Metadata deriving (Bits, Eq, FShow);");
   builder->append_line("instance DefaultValue#(Metadata);");
@@ -162,6 +198,22 @@ void FPGAProgram::emitHeaders(CodeBuilder* builder) {
   builder->append_line("} Headers deriving (Bits, Eq, FShow);");
 }
 
+// host side names of the ids taken by table_load, see MainAPI.bsv
+void FPGAProgram::emitTableIds(CodeBuilder* builder) {
+  builder->append_line("typedef enum {");
+  builder->incr_indent();
+  int count = 0;
+  for (auto control : {ingress, egress}) {
+    for (auto t : control->tables) {
+      builder->append_line("Table%s = %d,", CamelCase(t.first), control->tableId(t.first));
+      count++;
+    }
+  }
+  builder->append_line("TableNone = %d", count);
+  builder->decr_indent();
+  builder->append_line("} TableId deriving (Bits, Eq, FShow);");
+}
+
 void FPGAProgram::emit(BSVProgram & bsv, CppProgram & cpp) {
   for (auto f : parser->parseStateMap) {
     LOG1(f.first << f.second);
@@ -170,12 +222,23 @@ void FPGAProgram::emit(BSVProgram & bsv, CppProgram & cpp) {
   emitImportStatements(bsv);
   emitIncludeStatements(bsv);
 
-  parser->emit(bsv);
-  ingress->emit(bsv, cpp);
-  egress->emit(bsv, cpp);
-  deparser->emit(bsv);
+  {
+    PassTimer timer("codegen.parser");
+    parser->emit(bsv);
+  }
+  {
+    PassTimer timer("codegen.control");
+    ingress->emit(bsv, cpp);
+    egress->emit(bsv, cpp);
+  }
+  emitTableIds(&bsv.getConnectalTypeBuilder());
+  {
+    PassTimer timer("codegen.deparser");
+    deparser->emit(bsv);
+  }
 
   // must generate metadata after processing pipelines
+  PassTimer timer("codegen.struct");
   CodeBuilder* builder = &bsv.getStructBuilder();
   emitHeaders(builder);
   emitMetadata(builder);
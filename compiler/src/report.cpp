@@ -0,0 +1,243 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include "lib/json.h"
+#include "backend.h"
+#include "dependency.h"
+#include "fcontrol.h"
+#include "fparser.h"
+#include "table.h"
+
+namespace FPGA {
+
+// The numbers below are rough per-bit models of the generated modules on a
+// 7-series part; they are meant to reject programs that obviously do not
+// fit, not to replace the Vivado report.
+static const int kClockMHz = 250;
+// mkTable wrapper: rx/tx, completion buffer and a one step action engine
+static const int kTableWrapperCycles = 6;
+// request and response fifo between control rules
+static const int kFifoCycles = 2;
+// fork and join rules around a parallel stage
+static const int kStageCycles = 2;
+
+struct TableEstimate {
+  cstring name;
+  cstring type;
+  int size = 0;
+  int depth = 0;
+  int key_width = 0;
+  int action_width = 0;
+  int bram = 0;
+  int lut = 0;
+  int ff = 0;
+  int cycles = 0;
+};
+
+static TableEstimate estimateTable(cstring name, const TableProfile& t) {
+  TableEstimate e;
+  e.name = name;
+  e.type = t.type;
+  e.action_width = t.action_width;
+  auto sizing = TableCodeGen::getTableSizing(t.memory, t.shadow, t.size, t.key_width,
+                                             t.action_width);
+  e.size = sizing.size;
+  e.key_width = sizing.key_width;
+  e.depth = sizing.depth;
+  e.bram = sizing.bram;
+  cstring match = t.memory;
+  if (match == "cuckoo") {
+    // fourteen key compares (two buckets, the stash and the entries being
+    // moved) and two h3 xor trees
+    e.lut = 14 * e.key_width / 3 + e.key_width + 2 * e.action_width + 300;
+    e.ff = 8 * e.key_width + 8 * e.action_width + 200;
+    // hash, bucket read and compare
+    e.cycles = 4;
+  } else if (match == "exact") {
+    // four hash units xor-folding the key, key compare on the m-table
+    e.lut = 4 * e.key_width + e.key_width / 3 + 2 * e.action_width + 200;
+    e.ff = 4 * e.key_width + 2 * e.action_width + 150;
+    // hash, g-table read, m-table read and compare
+    e.cycles = 7;
+  } else {
+    // and-reduce of the 9-bit slices and the priority encoder
+    e.lut = e.depth * (e.key_width / 9) / 3 + e.depth + 100;
+    e.ff = 2 * e.depth + 2 * e.key_width + 100;
+    // slice read, and-reduce, encode, action ram read
+    e.cycles = 8;
+  }
+  e.cycles += kTableWrapperCycles;
+  return e;
+}
+
+// steps of the longest action engine of a table, each one is a cycle
+static int actionStages(FPGAControl* control, const IR::P4Table* table) {
+  int stages = 1;
+  for (auto a : table->getActionList()->actionList) {
+    auto k = control->actions.find(a->getPath()->name.toString());
+    if (k == control->actions.end()) continue;
+    auto name = nameFromAnnotation(k->second->annotations, k->second->name);
+    auto s = control->action_stages.find(name);
+    if (s != control->action_stages.end()) {
+      stages = std::max(stages, s->second);
+    }
+  }
+  return stages;
+}
+
+static Util::JsonObject* toJson(const TableEstimate& e) {
+  auto obj = new Util::JsonObject();
+  obj->emplace("name", new Util::JsonValue(e.name));
+  obj->emplace("match_type", new Util::JsonValue(e.type));
+  obj->emplace("size", new Util::JsonValue(e.size));
+  obj->emplace("depth", new Util::JsonValue(e.depth));
+  obj->emplace("key_width", new Util::JsonValue(e.key_width));
+  obj->emplace("action_width", new Util::JsonValue(e.action_width));
+  obj->emplace("bram36", new Util::JsonValue(e.bram));
+  obj->emplace("lut", new Util::JsonValue(e.lut));
+  obj->emplace("ff", new Util::JsonValue(e.ff));
+  obj->emplace("cycles", new Util::JsonValue(e.cycles));
+  return obj;
+}
+
+// Per control block: table estimates, pipeline stages in CFG order, and the
+// latency of the longest path from entry to exit.
+static Util::JsonObject* reportControl(FPGAControl* control, Profiler* profgen,
+                                       int* bram, int* lut, int* ff, int* cycles) {
+  auto result = new Util::JsonObject();
+  std::map<cstring, TableEstimate> estimates;
+  auto tables = new Util::JsonArray();
+  for (auto t : control->tables) {
+    auto profile = profgen->getTables().find(t.second->name);
+    if (profile == profgen->getTables().end()) continue;
+    auto e = estimateTable(t.first, profile->second);
+    e.cycles += actionStages(control, t.second) - 1;
+    estimates[t.first] = e;
+    tables->append(toJson(e));
+    *bram += e.bram;
+    *lut += e.lut;
+    *ff += e.ff;
+  }
+  result->emplace("tables", tables);
+
+  // latency of each node, a parallel stage is charged to its first table
+  std::map<const CFG::Node*, int> weight;
+  auto stages = new Util::JsonArray();
+  if (control->cfg != nullptr) {
+    for (auto node : control->cfg->allNodes) {
+      if (node->is<CFG::IfNode>()) {
+        weight[node] = 1;
+      } else if (node->is<CFG::TableNode>()) {
+        auto t = node->to<CFG::TableNode>();
+        auto stage = control->deps->getStage(t->name);
+        if (stage != nullptr && stage->front() != t) {
+          weight[node] = 0;
+          continue;
+        }
+        auto stage_obj = new Util::JsonObject();
+        auto names = new Util::JsonArray();
+        int depth = 0;
+        if (stage == nullptr) {
+          names->append(new Util::JsonValue(t->name));
+          depth = estimates[t->name].cycles + kFifoCycles;
+        } else {
+          for (auto s : *stage) {
+            names->append(new Util::JsonValue(s->name));
+            depth = std::max(depth, estimates[s->name].cycles);
+          }
+          depth += kFifoCycles + kStageCycles;
+        }
+        weight[node] = depth;
+        stage_obj->emplace("tables", names);
+        stage_obj->emplace("cycles", new Util::JsonValue(depth));
+        stages->append(stage_obj);
+      } else {
+        weight[node] = 0;
+      }
+    }
+  }
+  result->emplace("stages", stages);
+
+  // the control flow graph is acyclic, memoize the longest path to exit
+  std::map<const CFG::Node*, int> longest;
+  std::function<int(const CFG::Node*)> walk = [&](const CFG::Node* node) {
+    auto it = longest.find(node);
+    if (it != longest.end()) return it->second;
+    int tail = 0;
+    for (auto e : node->successors.edges) {
+      tail = std::max(tail, walk(e->endpoint));
+    }
+    longest[node] = weight[node] + tail;
+    return longest[node];
+  };
+  // entry and exit rules
+  int latency = 2;
+  if (control->cfg != nullptr && control->cfg->entryPoint != nullptr) {
+    latency += walk(control->cfg->entryPoint);
+  }
+  result->emplace("latency_cycles", new Util::JsonValue(latency));
+  *cycles += latency;
+  return result;
+}
+
+// parser and deparser handle one bus beat per cycle
+static int headerCycles(FPGAProgram* program) {
+  auto type = program->typeMap->getType(program->parser->headers);
+  if (type == nullptr || !type->is<IR::Type_Struct>()) return 0;
+  int width = 0;
+  for (auto f : type->to<IR::Type_Struct>()->fields) {
+    auto t = program->typeMap->getType(f, true);
+    if (t->is<IR::Type_Header>()) {
+      width += t->width_bits();
+    }
+  }
+  int beat = program->datapathWidth;
+  return (width + beat - 1) / beat + 1;
+}
+
+void generate_report(const FPGAOptions& options, FPGAProgram* program, Profiler* profgen) {
+  int bram = 0, lut = 0, ff = 0, cycles = 0;
+  auto report = new Util::JsonObject();
+  report->emplace("clock_mhz", new Util::JsonValue(kClockMHz));
+  report->emplace("ingress", reportControl(program->ingress, profgen, &bram, &lut, &ff, &cycles));
+  report->emplace("egress", reportControl(program->egress, profgen, &bram, &lut, &ff, &cycles));
+  int hdr = headerCycles(program);
+  report->emplace("parser_cycles", new Util::JsonValue(hdr));
+  report->emplace("deparser_cycles", new Util::JsonValue(hdr));
+  cycles += 2 * hdr;
+
+  auto total = new Util::JsonObject();
+  total->emplace("bram36", new Util::JsonValue(bram));
+  total->emplace("lut", new Util::JsonValue(lut));
+  total->emplace("ff", new Util::JsonValue(ff));
+  total->emplace("latency_cycles", new Util::JsonValue(cycles));
+  total->emplace("latency_ns", new Util::JsonValue(cycles * 1000 / kClockMHz));
+  report->emplace("total", total);
+
+  boost::filesystem::path dir(options.outputFile);
+  boost::filesystem::create_directory(dir);
+  boost::filesystem::path reportPath = dir / boost::filesystem::path("report.json");
+  std::ofstream out(reportPath.native());
+  report->serialize(out);
+  out << std::endl;
+}
+
+}  // namespace FPGA
@@ -16,6 +16,8 @@
 */
 
 #include <algorithm>
+#include <cmath>
+#include <iostream>
 #include <string>
 #include "table.h"
 #include "fcontrol.h"
@@ -124,9 +126,8 @@ void TableCodeGen::emitTableResponseType(const IR::P4Table* table) {
     const IR::Type_Bits* param = f.second;
     //builder->append_line("Bit#(%d) %s;", param->size, pname);
     type_builder->append_format("Bit#(%d) %s;", param->size, pname);
-    action_size += param->size;
   }
-  action_size += ceil(log2(actionList.size()));
+  action_size = getActionWidth(actionList.size(), param_extractor.param_map);
   type_builder->decr_indent();
   type_builder->append_format("} %sRspT deriving (Bits, FShow);", type);
   //builder->decr_indent();
@@ -146,10 +147,7 @@ void TableCodeGen::emitTypedefs(const IR::P4Table* table) {
 void TableCodeGen::emitSimulation(const IR::P4Table* table) {
   auto name = nameFromAnnotation(table->annotations, table->name);
   auto id = table->declid % 32;
-  auto remainder = key_width % 9;
-  if (remainder != 0) {
-    key_width = key_width + 9 - remainder;
-  }
+  key_width = getKeyWidth(key_width);
   builder->append_line("`MATCHTABLE_SIM(%d, %d, %d, %s)", id, key_width, action_size, name);
 }
 
@@ -204,9 +202,10 @@ void TableCodeGen::emitFunctionExecute(const IR::P4Table* table) {
   int actionSize = (actionList != nullptr) ? actionList->size() : 0;
   builder->append_line("instance Table_execute #(ConnectalTypes::%sRspT, %sParam, %d);", type, type, actionSize);
   builder->incr_indent();
-  builder->append_line("function Action table_execute(ConnectalTypes::%sRspT resp, MetadataRequest metadata, Vector#(%d, FIFOF#(Tuple2#(MetadataRequest, %sParam))) fifos);", type, actionSize, type);
+  builder->append_line("function ActionValue#(Bool) table_execute(ConnectalTypes::%sRspT resp, MetadataRequest metadata, Vector#(%d, FIFOF#(Tuple2#(MetadataRequest, %sParam))) fifos);", type, actionSize, type);
   builder->incr_indent();
-  builder->append_line("action");
+  builder->append_line("actionvalue");
+  builder->append_line("Bool taken = True;");
   builder->append_line("case (unpack(resp._action)) matches");
   builder->incr_indent();
   if (actionList != nullptr) {
@@ -215,9 +214,12 @@ void TableCodeGen::emitFunctionExecute(const IR::P4Table* table) {
       p->apply(printer);
     }
   }
+  // unknown action id, mkTable forwards the metadata unchanged
+  builder->append_line("default: taken = False;");
   builder->decr_indent();
   builder->append_line("endcase");
-  builder->append_line("endaction");
+  builder->append_line("return taken;");
+  builder->append_line("endactionvalue");
   builder->decr_indent();
   builder->append_line("endfunction");
   builder->decr_indent();
@@ -281,41 +283,296 @@ void TableCodeGen::emit(const IR::P4Table* table) {
   int actionSize = (actionList != nullptr) ? actionList->size() : 0;
   CHECK_NULL(builder);
   builder->append_line("typedef Table#(%d, MetadataRequest, %sParam, ConnectalTypes::%sReqT, ConnectalTypes::%sRspT) %sTable;", actionSize, type, type, type, type);
-  builder->append_line("typedef MatchTable#(1, %d, %d, SizeOf#(ConnectalTypes::%sReqT), SizeOf#(ConnectalTypes::%sRspT)) %sMatchTable;", id, 256, type, type, type);
+  // HASH(1) or CUCKOO(5) for exact match, TCAM(3) for ternary and LPM(6)
+  // for lpm, see MatchTable.bsv
+  if (match_type != "exact" && isCuckoo(table)) {
+    ::warning("%1%: @cuckoo only applies to exact match tables, using a tcam", table);
+  }
+  cstring memory = getTableMemory(table, match_type);
+  int tp = 3;
+  if (memory == "exact") {
+    tp = 1;
+  } else if (memory == "cuckoo") {
+    tp = 5;
+  } else if (memory == "lpm") {
+    tp = 6;
+  }
+  auto sizing = getTableSizing(memory, isShadow(table), table_size, key_width, action_size);
+  table_depth = sizing.depth;
+  int bram = sizing.bram;
+  LOG1("table " << name << " (id " << control->tableId(name) << "): "
+       << match_type << " match, size " << table_size
+       << ", depth " << table_depth << ", key " << key_width << "b, value "
+       << action_size << "b, " << bram << " BRAM36"
+       << (tp == 5 ? ", cuckoo" : "")
+       << (isShadow(table) ? ", shadowed" : ""));
+  builder->append_line("// %s: size %d, depth %d, %d BRAM36", name, table_size, table_depth, bram);
+  builder->append_line("typedef MatchTable#(%d, %d, %d, SizeOf#(ConnectalTypes::%sReqT), SizeOf#(ConnectalTypes::%sRspT)) %sMatchTable;", tp, id, table_depth, type, type, type);
   builder->append_line("`SynthBuildModule1(mkMatchTable, String, %sMatchTable, mkMatchTable_%s)", type, type);
+  if (isShadow(table)) {
+    builder->append_line("typedef ShadowMatchTable#(%d, %d, %d, SizeOf#(ConnectalTypes::%sReqT), SizeOf#(ConnectalTypes::%sRspT)) %sShadowTable;", tp, id, table_depth, type, type, type);
+  }
   emitFunctionLookup(table);
   emitFunctionExecute(table);
 }
 
+// C type used by BDPI to pass a Bit#(width) argument, wider values
+// are passed as pointer to an array of 32-bit words.
+static cstring bdpiType(int width) {
+  if (width <= 8) {
+    return "unsigned char";
+  } else if (width <= 16) {
+    return "unsigned short";
+  } else if (width <= 32) {
+    return "unsigned int";
+  } else if (width <= 64) {
+    return "unsigned long long";
+  }
+  return "unsigned int*";
+}
+
+int TableCodeGen::getTableSize(const IR::P4Table* table) {
+  for (auto p : table->properties->properties) {
+    if (!p->is<IR::Property>()) continue;
+    auto pp = p->to<IR::Property>();
+    if (pp->name != "size") continue;
+    auto expr = pp->value->to<IR::ExpressionValue>();
+    if (expr != nullptr && expr->expression->is<IR::Constant>()) {
+      return expr->expression->to<IR::Constant>()->asInt();
+    }
+  }
+  return kDefaultTableSize;
+}
+
+// Round the P4 'size' to a depth the hardware table can be built with.
+// DMHC needs a power of two no larger than 2^(keySz-1), since the g-tables are
+// addressed with TLog#(2*depth) key bits. Tcam depth is bounded by the
+// priority encoders implemented in PriorityEncoder.bsv. The cuckoo hash is
+// sized for a 90% load, and has at least two four-entry buckets per way.
+int TableCodeGen::getTableDepth(cstring match_type, int size, int key_width) {
+  if (match_type == "cuckoo") {
+    int depth = 16;
+    while (depth * 9 < size * 10) depth <<= 1;
+    return depth;
+  }
+  if (match_type == "exact") {
+    int depth = 16;
+    while (depth < size) depth <<= 1;
+    if (key_width == 0) return depth;
+    int max_depth = (key_width > 24) ? (1 << 23) : (1 << (key_width - 1));
+    if (depth > max_depth) {
+      ::warning("table size %d exceeds %d-bit key space, using depth %d", size, key_width, max_depth);
+      depth = max_depth;
+    }
+    return depth;
+  }
+  // sizes with a PEncoder instance, see PriorityEncoder.bsv
+  static const int pencoder[] = {2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+  for (auto depth : pencoder) {
+    if (depth >= size) return depth;
+  }
+  ::error("table size %d exceeds the largest tcam of 1024 entries", size);
+  return 1024;
+}
+
+// number of RAMB36 needed for a depth x width memory, picking the best
+// of the 7-series aspect ratios
+static int bram36(int depth, int width) {
+  static const int shape[][2] = {{32768, 1}, {16384, 2}, {8192, 4}, {4096, 9},
+                                 {2048, 18}, {1024, 36}, {512, 72}};
+  if (depth == 0 || width == 0) return 0;
+  int best = -1;
+  for (auto s : shape) {
+    int n = ((depth + s[0] - 1) / s[0]) * ((width + s[1] - 1) / s[1]);
+    if (best < 0 || n < best) best = n;
+  }
+  return best;
+}
+
+// DMHC keeps a depth-entry m-table of {valid, key, value} and four 2*depth
+// g-tables of {value, maddr, mslot, degree}; Tcam keeps one 512 x depth RAM
+// per 9-bit key slice and a depth-entry action RAM. The cuckoo hash keeps
+// two depth/8 rams of four {valid, key, value, id} entries and a
+// depth-entry location ram.
+int TableCodeGen::getBramCost(cstring match_type, int depth, int key_width, int value_width) {
+  int addr = ceil(log2(depth));
+  if (match_type == "cuckoo") {
+    int ways = 2 * bram36(depth / 8, 4 * (1 + key_width + value_width + addr));
+    return ways + bram36(depth, addr + 1);
+  }
+  if (match_type == "exact") {
+    int m_table = bram36(depth, 1 + key_width + value_width);
+    int g_table = bram36(2 * depth, value_width + 2 * addr + 2);
+    return m_table + 4 * g_table;
+  }
+  if (match_type == "lpm") {
+    // the action ram keeps each slot's handle, key and mask are kept to
+    // move entries between prefix length regions
+    return (key_width / 9) * bram36(512, depth) + bram36(depth, addr + value_width)
+        + bram36(depth, 2 * key_width);
+  }
+  return (key_width / 9) * bram36(512, depth) + bram36(depth, value_width);
+}
+
+int TableCodeGen::getKeyWidth(int key_width) {
+  return key_width + (9 - key_width % 9) % 9;
+}
+
+int TableCodeGen::getActionWidth(int actions,
+                                 const std::map<cstring, const IR::Type_Bits*>& params) {
+  int width = ceil(log2(actions));
+  for (auto p : params) {
+    width += p.second->size;
+  }
+  return width;
+}
+
+// A size of 0 is a table without a 'size' property. A shadowed table holds
+// a second copy of its memory.
+TableSizing TableCodeGen::getTableSizing(cstring memory, bool shadow, int size,
+                                         int key_width, int value_width) {
+  TableSizing s;
+  s.size = (size == 0) ? kDefaultTableSize : size;
+  s.key_width = getKeyWidth(key_width);
+  s.depth = getTableDepth(memory, s.size, s.key_width);
+  s.bram = getBramCost(memory, s.depth, s.key_width, value_width);
+  if (shadow) {
+    s.bram *= 2;
+  }
+  return s;
+}
+
+void TableCodeGen::emitCppModel(CodeBuilder* cpp_builder) {
+  cpp_builder->appendLine(kMatchTableModel);
+}
+
+// Table uses ternary match if any key is ternary, or if lpm is mixed with
+// other keys; a single lpm key is matched with the lpm trie.
+cstring TableCodeGen::getMatchType(const IR::P4Table* table) {
+  auto keys = table->getKey();
+  if (keys == nullptr) return "exact";
+  int n_lpm = 0;
+  bool ternary = false;
+  for (auto key : keys->keyElements) {
+    auto element = key->to<IR::KeyElement>();
+    if (element == nullptr) continue;
+    if (!element->matchType->is<IR::PathExpression>()) continue;
+    auto type = element->matchType->to<IR::PathExpression>()->path->name;
+    if (type == "ternary") {
+      ternary = true;
+    } else if (type == "lpm") {
+      n_lpm++;
+    }
+  }
+  if (ternary || (n_lpm > 0 && keys->keyElements.size() > 1)) {
+    return "ternary";
+  } else if (n_lpm > 0) {
+    return "lpm";
+  }
+  return "exact";
+}
+
+// copy a BDPI argument of 'width' bits into a word array
+static void emitCppWords(CodeBuilder* cpp_builder, cstring dst, cstring src, int width) {
+  int words = std::max(1, (width + 31) / 32);
+  if (width > 64) {
+    cpp_builder->append_line("memcpy(%s, %s, sizeof(%s));", dst, src, dst);
+    if (width % 32 != 0) {
+      cpp_builder->append_line("%s[%d] &= 0x%x;", dst, words - 1, (1u << (width % 32)) - 1);
+    }
+  } else {
+    cpp_builder->append_line("matchtable_pack(%s, %s, %d);", dst, src, words);
+  }
+}
+
 void TableCodeGen::emitCpp(const IR::P4Table* table) {
   auto name = nameFromAnnotation(table->annotations, table->name);
-  auto type = CamelCase(name);
-  cpp_builder->append_line("typedef uint64_t %sReqT;", type);
-  cpp_builder->append_line("typedef uint64_t %sRspT;", type);
-  cpp_builder->append_line("std::unordered_map<%sReqT, %sRspT> tbl_%s;", type, type, name);
-  cpp_builder->append_line("extern \"C\" %sReqT matchtable_read_%s(%sReqT rdata) {", type, name, type);
-  cpp_builder->incr_indent();
-  cpp_builder->append_line("auto it = tbl_%s.find(rdata);", name);
+  int key_words = std::max(1, (key_width + 31) / 32);
+  int val_words = std::max(1, (action_size + 31) / 32);
+  cstring key_type = bdpiType(key_width);
+  cstring val_type = bdpiType(action_size);
+  bool wide_val = action_size > 64;
+  cpp_builder->append_line("// %s: %s match, %d-bit key, %d-bit value, %d entries", name, match_type, key_width, action_size, table_depth);
+  if (match_type == "lpm") {
+    cpp_builder->append_line("LpmTableModel<%d, %d> tbl_%s(%d, %d);", key_words, val_words, name, table_depth, lpm_width);
+  } else if (match_type == "ternary") {
+    cpp_builder->append_line("TernaryTableModel<%d, %d> tbl_%s(%d);", key_words, val_words, name, table_depth);
+  } else {
+    cpp_builder->append_line("MatchTableModel<%d, %d> tbl_%s(%d);", key_words, val_words, name, table_depth);
+  }
 
-  cpp_builder->append_line("if (it != tbl_%s.end()) {", name);
-  cpp_builder->incr_indent();
-  cpp_builder->append_line("return tbl_%s[rdata];", name);
-  cpp_builder->decr_indent();
-  cpp_builder->append_line("} else {");
+  // BDPI returns values wider than 64 bits through a leading result pointer
+  if (wide_val) {
+    cpp_builder->append_line("extern \"C\" void matchtable_read_%s(unsigned int* result, %s rdata) {", name, key_type);
+  } else {
+    cpp_builder->append_line("extern \"C\" %s matchtable_read_%s(%s rdata) {", val_type, name, key_type);
+  }
   cpp_builder->incr_indent();
-  cpp_builder->append_line("return 0;");
+  cpp_builder->append_line("uint32_t key[%d];", key_words);
+  emitCppWords(cpp_builder, "key", "rdata", key_width);
+  cpp_builder->append_line("const uint32_t* v = tbl_%s.find(key);", name);
+  if (wide_val) {
+    cpp_builder->append_line("if (v == nullptr) {");
+    cpp_builder->incr_indent();
+    cpp_builder->append_line("memset(result, 0, %d * sizeof(uint32_t));", val_words);
+    cpp_builder->decr_indent();
+    cpp_builder->append_line("} else {");
+    cpp_builder->incr_indent();
+    cpp_builder->append_line("memcpy(result, v, %d * sizeof(uint32_t));", val_words);
+    cpp_builder->decr_indent();
+    cpp_builder->append_line("}");
+  } else {
+    cpp_builder->append_line("return (v == nullptr) ? 0 : matchtable_unpack(v, %d);", val_words);
+  }
   cpp_builder->decr_indent();
   cpp_builder->append_line("}");
+
+  cpp_builder->append_line("extern \"C\" void matchtable_write_masked_%s(%s wdata, %s wmask, %s action){", name, key_type, key_type, val_type);
+  cpp_builder->incr_indent();
+  cpp_builder->append_line("uint32_t key[%d];", key_words);
+  cpp_builder->append_line("uint32_t mask[%d];", key_words);
+  cpp_builder->append_line("uint32_t val[%d];", val_words);
+  emitCppWords(cpp_builder, "key", "wdata", key_width);
+  emitCppWords(cpp_builder, "mask", "wmask", key_width);
+  emitCppWords(cpp_builder, "val", "action", action_size);
+  cpp_builder->append_line("tbl_%s.insert(key, mask, val);", name);
   cpp_builder->decr_indent();
   cpp_builder->append_line("}");
 
-  cpp_builder->append_line("extern \"C\" void matchtable_write_%s(%sReqT wdata, %sRspT action){", name, type, type);
+  cpp_builder->append_line("extern \"C\" void matchtable_write_%s(%s wdata, %s action){", name, key_type, val_type);
   cpp_builder->incr_indent();
-  cpp_builder->append_line("tbl_%s[wdata] = action;", name);
+  cpp_builder->append_line("uint32_t key[%d];", key_words);
+  cpp_builder->append_line("uint32_t mask[%d];", key_words);
+  cpp_builder->append_line("uint32_t val[%d];", val_words);
+  emitCppWords(cpp_builder, "key", "wdata", key_width);
+  cpp_builder->append_line("memset(mask, 0xff, sizeof(mask));");
+  emitCppWords(cpp_builder, "val", "action", action_size);
+  cpp_builder->append_line("tbl_%s.insert(key, mask, val);", name);
   cpp_builder->decr_indent();
   cpp_builder->append_line("}");
 }
 
+bool TableCodeGen::isShadow(const IR::P4Table* table) {
+  return table->annotations->getSingle("shadow") != nullptr;
+}
+
+bool TableCodeGen::isCuckoo(const IR::P4Table* table) {
+  return table->annotations->getSingle("cuckoo") != nullptr;
+}
+
+bool TableCodeGen::isIndexed(const IR::P4Table* table) {
+  return getMatchType(table) != "exact" || isCuckoo(table) || isShadow(table);
+}
+
+// memory a table is built on: "exact" (DMHC), "cuckoo", "ternary" or "lpm"
+cstring TableCodeGen::getTableMemory(const IR::P4Table* table, cstring match_type) {
+  if (match_type != "exact") return match_type;
+  if (isCuckoo(table)) return "cuckoo";
+  // a load clears the idle copy of a shadowed table, dmhc cannot delete
+  if (isShadow(table)) return "cuckoo";
+  return match_type;
+}
+
 bool TableCodeGen::preorder(const IR::P4Table* table) {
   auto tbl = table->to<IR::P4Table>();
   for (auto act : tbl->getActionList()->actionList) {
@@ -352,9 +609,15 @@ bool TableCodeGen::preorder(const IR::P4Table* table) {
           key_vec.push_back(std::make_pair(f, f_size));
           key_width += f_size;
         }
+        auto kind = element->matchType->to<IR::PathExpression>();
+        if (kind != nullptr && kind->path->name == "lpm") {
+          lpm_width = key_vec.back().second;
+        }
       }
     }
   }
+  table_size = getTableSize(tbl);
+  match_type = getMatchType(tbl);
   //FIXME: switch.p4 does not like this.
   emitTypedefs(tbl);
   emitSimulation(tbl);
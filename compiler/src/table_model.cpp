@@ -0,0 +1,297 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "table.h"
+
+namespace FPGA {
+
+// C++ match table models compiled into Bluesim through BDPI, emitted once
+// at the top of matchtable_model.cpp and shared by all generated tables.
+const char* kMatchTableModel = R"MODEL(#ifndef P4FPGA_MATCHTABLE_MODEL
+#define P4FPGA_MATCHTABLE_MODEL
+// Keys and values are arrays of 32-bit words, least significant word
+// first, which is the layout BDPI uses for Bit#(n) wider than 64 bits.
+static inline void matchtable_pack(uint32_t* dst, uint64_t v, int words) {
+    for (int i = 0; i < words; i++) dst[i] = (i < 2) ? (uint32_t)(v >> (32 * i)) : 0;
+}
+static inline uint64_t matchtable_unpack(const uint32_t* src, int words) {
+    uint64_t v = src[0];
+    if (words > 1) v |= (uint64_t)src[1] << 32;
+    return v;
+}
+static inline int matchtable_bit(const uint32_t* key, int pos) {
+    return (key[pos / 32] >> (pos % 32)) & 1;
+}
+
+// Exact match: open-addressing hash table with linear probing, sized at
+// construction so that lookups never allocate and cost one probe sequence.
+template <int KW, int VW>
+class MatchTableModel {
+ public:
+    struct Entry {
+        bool used;
+        uint32_t key[KW];
+        uint32_t val[VW];
+    };
+    explicit MatchTableModel(size_t size) : count(0) { resize(size); }
+    const uint32_t* find(const uint32_t* key) const {
+        size_t i = hash(key) & mask;
+        while (slots[i].used) {
+            if (memcmp(slots[i].key, key, sizeof(slots[i].key)) == 0)
+                return slots[i].val;
+            i = (i + 1) & mask;
+        }
+        return nullptr;
+    }
+    uint32_t* insert(const uint32_t* key, const uint32_t* val) {
+        if (2 * (count + 1) > slots.size())
+            resize(slots.size());
+        Entry* e = probe(key);
+        if (!e->used) {
+            e->used = true;
+            memcpy(e->key, key, sizeof(e->key));
+            count++;
+        }
+        memcpy(e->val, val, sizeof(e->val));
+        return e->val;
+    }
+    // exact tables ignore the mask of a masked write
+    void insert(const uint32_t* key, const uint32_t* key_mask, const uint32_t* val) {
+        insert(key, val);
+    }
+ private:
+    std::vector<Entry> slots;
+    size_t mask;
+    size_t count;
+    static size_t hash(const uint32_t* key) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < KW; i++) {
+            h = (h ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+    Entry* probe(const uint32_t* key) {
+        size_t i = hash(key) & mask;
+        while (slots[i].used && memcmp(slots[i].key, key, sizeof(slots[i].key)) != 0)
+            i = (i + 1) & mask;
+        return &slots[i];
+    }
+    // keep load factor at or below 1/2, grows only on insert
+    void resize(size_t size) {
+        size_t cap = 16;
+        while (cap < 2 * size) cap <<= 1;
+        std::vector<Entry> old;
+        old.swap(slots);
+        slots.assign(cap, Entry());
+        mask = cap - 1;
+        for (auto& e : old) {
+            if (e.used) *probe(e.key) = e;
+        }
+    }
+};
+
+// Prefix match: multibit trie with 8-bit stride. Each node keeps its
+// children and its prefix-expanded leaves in arrays compressed with 256-bit
+// bitmaps (poptrie), so a lookup costs one popcount per level.
+// The prefix covers the low 'width' bits of the key, from the MSB down.
+// The longest matching prefix wins whatever the install order, as in the
+// hardware, which keeps its TCAM sorted by prefix length. A prefix is
+// stored in the node of its last stride, so a deeper node holds a longer
+// prefix and within a node each slot keeps its longest prefix.
+template <int KW, int VW>
+class LpmTableModel {
+ public:
+    LpmTableModel(size_t size, int width) : width(width) {
+        nodes.reserve(size / 4 + 1);
+        values.reserve(size * VW);
+        nodes.push_back(Node());
+    }
+    const uint32_t* find(const uint32_t* key) const {
+        int best = -1;
+        uint32_t n = 0;
+        for (int pos = 0; pos < width; pos += 8) {
+            const Node& node = nodes[n];
+            int slot = chunk(key, pos);
+            int leaf = node.leaves[rank(node.leaf_bm, slot) - 1];
+            if (leaf >= 0) best = leaf;
+            if (!test(node.child_bm, slot)) break;
+            n = node.children[rank(node.child_bm, slot) - 1];
+        }
+        return (best < 0) ? nullptr : &values[best * VW];
+    }
+    void insert(const uint32_t* key, const uint32_t* key_mask, const uint32_t* val) {
+        int len = 0;
+        for (int pos = 0; pos < width; pos++) {
+            if (!matchtable_bit(key_mask, width - 1 - pos)) break;
+            len++;
+        }
+        uint32_t n = 0;
+        int pos = 0;
+        // a prefix is stored in the node where its last stride begins
+        while (len - pos > 8) {
+            int slot = chunk(key, pos);
+            if (!test(nodes[n].child_bm, slot)) {
+                uint32_t c = nodes.size();
+                nodes.push_back(Node());
+                nodes[n].children.insert(nodes[n].children.begin() + rank(nodes[n].child_bm, slot), c);
+                nodes[n].child_bm[slot / 64] |= 1ULL << (slot % 64);
+            }
+            n = nodes[n].children[rank(nodes[n].child_bm, slot) - 1];
+            pos += 8;
+        }
+        Node& node = nodes[n];
+        int plen = len - pos;
+        int bits = (plen == 0) ? 0 : chunk(key, pos) >> (8 - plen);
+        for (auto& p : node.prefixes) {
+            if (p.len == plen && p.bits == bits) {
+                memcpy(&values[p.leaf * VW], val, VW * sizeof(uint32_t));
+                return;
+            }
+        }
+        Prefix p = {bits, plen, (int)(values.size() / VW)};
+        values.insert(values.end(), val, val + VW);
+        node.prefixes.push_back(p);
+        expand(node);
+    }
+ private:
+    struct Prefix {
+        int bits;
+        int len;
+        int leaf;
+    };
+    struct Node {
+        uint64_t child_bm[4];
+        uint64_t leaf_bm[4];
+        std::vector<uint32_t> children;
+        std::vector<int> leaves;
+        std::vector<Prefix> prefixes;
+        Node() : leaves(1, -1) {
+            memset(child_bm, 0, sizeof(child_bm));
+            memset(leaf_bm, 0, sizeof(leaf_bm));
+            leaf_bm[0] = 1;
+        }
+    };
+    int width;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> values;
+    // 8 key bits starting 'pos' bits below the prefix MSB, zero padded
+    int chunk(const uint32_t* key, int pos) const {
+        int v = 0;
+        for (int i = 0; i < 8; i++) {
+            int b = width - 1 - pos - i;
+            v = (v << 1) | ((b >= 0) ? matchtable_bit(key, b) : 0);
+        }
+        return v;
+    }
+    static bool test(const uint64_t* bm, int slot) {
+        return (bm[slot / 64] >> (slot % 64)) & 1;
+    }
+    // number of set bits at or below 'slot'
+    static int rank(const uint64_t* bm, int slot) {
+        int r = 0;
+        for (int i = 0; i < slot / 64; i++) r += __builtin_popcountll(bm[i]);
+        uint64_t m = (slot % 64 == 63) ? ~0ULL : ((1ULL << (slot % 64 + 1)) - 1);
+        return r + __builtin_popcountll(bm[slot / 64] & m);
+    }
+    // rebuild the compressed leaf array after a prefix is added to a node:
+    // expand every prefix to the 256 slots, keeping the longest one, then
+    // keep only run boundaries
+    void expand(Node& node) {
+        int slot_leaf[256];
+        int slot_len[256];
+        for (int s = 0; s < 256; s++) {
+            slot_leaf[s] = -1;
+            slot_len[s] = -1;
+        }
+        for (auto& p : node.prefixes) {
+            int first = p.bits << (8 - p.len);
+            for (int s = first; s < first + (1 << (8 - p.len)); s++) {
+                if (p.len > slot_len[s]) {
+                    slot_leaf[s] = p.leaf;
+                    slot_len[s] = p.len;
+                }
+            }
+        }
+        memset(node.leaf_bm, 0, sizeof(node.leaf_bm));
+        node.leaves.clear();
+        for (int s = 0; s < 256; s++) {
+            if (s == 0 || slot_leaf[s] != slot_leaf[s - 1]) {
+                node.leaf_bm[s / 64] |= 1ULL << (s % 64);
+                node.leaves.push_back(slot_leaf[s]);
+            }
+        }
+    }
+};
+
+// Ternary match: tuple space search. Entries are grouped by mask, each
+// group is an exact match table on the masked key. Entries installed
+// earlier have higher priority, as in the hardware TCAM. Groups are kept
+// sorted by their highest priority entry so the search stops as soon as
+// no remaining group can beat the current match.
+template <int KW, int VW>
+class TernaryTableModel {
+ public:
+    explicit TernaryTableModel(size_t size) : size(size), seq(0) {}
+    const uint32_t* find(const uint32_t* key) const {
+        const uint32_t* best = nullptr;
+        uint32_t best_prio = UINT32_MAX;
+        for (auto& g : groups) {
+            if (g.prio >= best_prio) break;
+            uint32_t k[KW];
+            for (int i = 0; i < KW; i++) k[i] = key[i] & g.mask[i];
+            const uint32_t* v = g.table->find(k);
+            if (v != nullptr && v[0] < best_prio) {
+                best_prio = v[0];
+                best = v + 1;
+            }
+        }
+        return best;
+    }
+    void insert(const uint32_t* key, const uint32_t* key_mask, const uint32_t* val) {
+        size_t i = 0;
+        while (i < groups.size() && memcmp(groups[i].mask, key_mask, sizeof(groups[i].mask)) != 0) i++;
+        if (i == groups.size()) {
+            Group g;
+            memcpy(g.mask, key_mask, sizeof(g.mask));
+            g.prio = seq;
+            g.table = std::make_shared<MatchTableModel<KW, VW + 1>>(size);
+            groups.push_back(g);
+        }
+        uint32_t k[KW];
+        for (int j = 0; j < KW; j++) k[j] = key[j] & key_mask[j];
+        const uint32_t* old = groups[i].table->find(k);
+        uint32_t v[VW + 1];
+        v[0] = (old == nullptr) ? seq++ : old[0];
+        memcpy(v + 1, val, VW * sizeof(uint32_t));
+        groups[i].table->insert(k, v);
+        std::stable_sort(groups.begin(), groups.end(),
+                         [](const Group& a, const Group& b) { return a.prio < b.prio; });
+    }
+ private:
+    struct Group {
+        uint32_t mask[KW];
+        uint32_t prio;
+        std::shared_ptr<MatchTableModel<KW, VW + 1>> table;
+    };
+    size_t size;
+    uint32_t seq;
+    std::vector<Group> groups;
+};
+#endif)MODEL";
+
+}  // namespace FPGA
@@ -0,0 +1,70 @@
+/*
+  Copyright 2015-2016 P4FPGA Project
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include <iomanip>
+#include <vector>
+#include "timer.h"
+
+namespace FPGA {
+
+bool PassTimer::enabled = false;
+
+struct PassTime {
+  cstring name;
+  double ms;
+  int calls;
+};
+
+// in order of first use, so nested phases are listed under their parent
+static std::vector<PassTime>& passTimes() {
+  static std::vector<PassTime> times;
+  return times;
+}
+
+static PassTime* findPass(cstring name) {
+  for (auto& t : passTimes()) {
+    if (t.name == name) return &t;
+  }
+  return nullptr;
+}
+
+PassTimer::PassTimer(cstring name) : name(name) {
+  if (!enabled) return;
+  if (findPass(name) == nullptr)
+    passTimes().push_back({name, 0.0, 0});
+  start = std::chrono::steady_clock::now();
+}
+
+PassTimer::~PassTimer() {
+  if (!enabled) return;
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  auto t = findPass(name);
+  t->ms += elapsed.count();
+  t->calls++;
+}
+
+void PassTimer::report(std::ostream& out) {
+  if (!enabled) return;
+  out << std::setw(40) << std::left << "pass" << std::setw(12) << std::right << "ms"
+      << std::setw(8) << "calls" << std::endl;
+  for (auto& t : passTimes()) {
+    out << std::setw(40) << std::left << t.name << std::setw(12) << std::right
+        << std::fixed << std::setprecision(2) << t.ms << std::setw(8) << t.calls << std::endl;
+  }
+}
+
+}  // namespace FPGA
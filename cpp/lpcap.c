@@ -4,22 +4,116 @@ void device_writePacketData(uint64_t* data, uint8_t* mask, int sop, int eop);
 
 //static struct write_pcap_desc* writeFiles[32];
 
+#define PCAP_MAGIC        0xa1b2c3d4
+#define PCAP_MAGIC_NSEC   0xa1b23c4d
+
+int pcap_map_file(const char *filename, struct pcap_trace *trace) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        PRINT_ERR("open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct pcap_file_header)) {
+        PRINT_ERR("%s is not a pcap file\n", filename);
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        PRINT_ERR("mmap %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    const struct pcap_file_header *fh = static_cast<const struct pcap_file_header *>(base);
+    uint32_t magic = fh->magic;
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        trace->swapped = 0;
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        trace->swapped = 1;
+    } else {
+        PRINT_ERR("%s: bad pcap magic %x\n", filename, magic);
+        munmap(base, st.st_size);
+        return -1;
+    }
+    trace->base = static_cast<const unsigned char *>(base);
+    trace->size = st.st_size;
+    trace->offset = sizeof(struct pcap_file_header);
+    return 0;
+}
+
+void pcap_unmap_file(struct pcap_trace *trace) {
+    munmap(const_cast<unsigned char *>(trace->base), trace->size);
+    trace->base = NULL;
+    trace->size = 0;
+}
+
+/* returns a pointer to the packet inside the mapping, NULL at end of trace */
+const unsigned char *pcap_next_record(struct pcap_trace *trace, struct pcap_batch_hdr *hdr) {
+    /* on-disk record header has the same layout as pcap_batch_hdr */
+    if (trace->offset + sizeof(struct pcap_batch_hdr) > trace->size)
+        return NULL;
+    memcpy(hdr, trace->base + trace->offset, sizeof(struct pcap_batch_hdr));
+    if (trace->swapped) {
+        hdr->ts_sec = __builtin_bswap32(hdr->ts_sec);
+        hdr->ts_usec = __builtin_bswap32(hdr->ts_usec);
+        hdr->caplen = __builtin_bswap32(hdr->caplen);
+        hdr->len = __builtin_bswap32(hdr->len);
+    }
+    size_t data = trace->offset + sizeof(struct pcap_batch_hdr);
+    if (data + hdr->caplen > trace->size) {
+        PRINT_WRAN("truncated record at offset %zu\n", trace->offset);
+        return NULL;
+    }
+    trace->offset = data + hdr->caplen;
+    return trace->base + data;
+}
+
+/* Pack as many records as fit into buff, starting at the current record.
+ * Returns the number of bytes used, always a multiple of the beat size. */
+size_t pcap_fill_batch(struct pcap_trace *trace, char *buff, size_t size, struct pcap_trace_info *info) {
+    size_t used = 0;
+    struct pcap_batch_hdr hdr;
+    for (;;) {
+        size_t mark = trace->offset;
+        const unsigned char *packet = pcap_next_record(trace, &hdr);
+        if (packet == NULL)
+            break;
+        size_t padded = (hdr.caplen + BATCH_BEAT_BYTES - 1) & ~(size_t)(BATCH_BEAT_BYTES - 1);
+        if (used + BATCH_BEAT_BYTES + padded > size) {
+            if (used == 0) {
+                PRINT_ERR("packet of %d bytes does not fit in batch\n", hdr.caplen);
+                exit(-1);
+            }
+            trace->offset = mark;
+            break;
+        }
+        memcpy(buff + used, &hdr, sizeof(hdr));
+        used += BATCH_BEAT_BYTES;
+        memcpy(buff + used, packet, hdr.caplen);
+        memset(buff + used + hdr.caplen, 0, padded - hdr.caplen);
+        used += padded;
+        info->byte_count += hdr.len;
+        info->packet_count ++;
+    }
+    return used;
+}
+
 void load_pcap_file(const char *filename, struct pcap_trace_info *info) {
-    char errbuf[PCAP_ERRBUF_SIZE];
+    struct pcap_trace trace;
+    struct pcap_batch_hdr hdr;
     const unsigned char *packet;
-    pcap_t *pcap = NULL;
-    struct pcap_pkthdr header;
-    pcap = pcap_open_offline(filename, errbuf);
-    if (pcap == NULL) {
-        fprintf(stderr, "error reading pcap file: %s\n", errbuf);
+    if (pcap_map_file(filename, &trace) < 0) {
         exit(-1);
     }
-    while ((packet = pcap_next(pcap, &header)) != NULL) {
-        fprintf(stderr, "packet %p len %d\n", packet, header.caplen);
-        mem_copy(packet, header.caplen);
-        info->byte_count += header.len;
+    while ((packet = pcap_next_record(&trace, &hdr)) != NULL) {
+        mem_copy(packet, hdr.caplen);
+        info->byte_count += hdr.len;
         info->packet_count ++;
     }
+    pcap_unmap_file(&trace);
 }
 
 //void open_pcap_dump_file(char* fn_p) {
@@ -57,9 +151,14 @@ void mem_copy(const void *buff, int packet_size) {
 
     numBeats = packet_size / 8; // 16 bytes per beat for 128-bit datawidth;
     if (packet_size % 8) numBeats++;
-    PRINT_INFO("nBeats=%d, packetSize=%d\n", numBeats, packet_size);
     for (i=0; i<numBeats; i++) {
-        data[i%2] = *(static_cast<const uint64_t *>(buff) + i);
+        if (packet_size >= 8) {
+            data[i%2] = *(static_cast<const uint64_t *>(buff) + i);
+        } else {
+            // do not read past the end of a mapped trace
+            data[i%2] = 0;
+            memcpy(&data[i%2], static_cast<const uint64_t *>(buff) + i, packet_size);
+        }
         if (packet_size > 8) {
             mask[i%2] = 0xff;
             packet_size -= 8; // 64-bit
@@ -71,7 +170,6 @@ void mem_copy(const void *buff, int packet_size) {
         eop = (i/2 == (numBeats-1)/2);
         if (i%2) {
             device_writePacketData(data, mask, sop, eop);
-            PRINT_INFO("%016lx %016lx %0x %0x %d %d\n", data[1], data[0], mask[1], mask[0], sop, eop);
         }
 
         // last beat, padding with zero
@@ -81,7 +179,6 @@ void mem_copy(const void *buff, int packet_size) {
             data[1] = 0;
             mask[1] = 0;
             device_writePacketData(data, mask, sop, eop);
-            PRINT_INFO("%016lx %016lx %0x %0x %d %d\n", data[1], data[0], mask[1], mask[0], sop, eop);
         }
     }
 }
@@ -115,3 +212,120 @@ compute_idle (const struct pcap_trace_info *info, double rate, double link_speed
     return idle;
 }
 
+/* token bucket refill per cycle, in bytes << PKTGEN_TOKEN_FRAC_BITS */
+uint32_t compute_flow_rate(double rate, double link_speed) {
+    double bytes = rate / link_speed * PKTGEN_BYTES_PER_CYCLE;
+    return (uint32_t)(bytes * (1 << PKTGEN_TOKEN_FRAC_BITS));
+}
+
+/* 8-byte beats taken by a packet in the pktgen buffer, after the 16 to 8
+ * byte gearbox */
+static int flow_beats(int len) {
+    return ((len + 15) / 16) * 2;
+}
+
+static uint16_t ip_checksum(const unsigned char *hdr, int len) {
+    uint32_t sum = 0;
+    for (int i = 0; i < len; i += 2)
+        sum += (hdr[i] << 8) | hdr[i+1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* resize the template packet, keeping ipv4 and udp lengths consistent */
+static void resize_packet(const unsigned char *tmpl, int tmpl_len, unsigned char *buff, int len) {
+    memset(buff, 0, len);
+    memcpy(buff, tmpl, tmpl_len < len ? tmpl_len : len);
+    if (len < 34 || buff[12] != 0x08 || buff[13] != 0x00)
+        return;
+    unsigned char *ip = buff + 14;
+    int ihl = (ip[0] & 0xf) * 4;
+    int ip_len = len - 14;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len & 0xff;
+    ip[10] = ip[11] = 0;
+    uint16_t csum = ip_checksum(ip, ihl);
+    ip[10] = csum >> 8;
+    ip[11] = csum & 0xff;
+    if (ip[9] == 17 && len >= 14 + ihl + 8) {
+        unsigned char *udp = ip + ihl;
+        int udp_len = ip_len - ihl;
+        udp[4] = udp_len >> 8;
+        udp[5] = udp_len & 0xff;
+        udp[6] = udp[7] = 0;
+    }
+}
+
+/* Load one pktgen flow. Without imix, packets of the trace are loaded until
+ * the flow buffer is full. With imix, e.g. "64x7,576x4,1500", the first
+ * packet of the trace is resized to each size, interleaved by weight with
+ * smooth weighted round robin, and the mix is repeated while it fits. */
+void load_pcap_flow(const char *filename, const char *imix, struct pcap_trace_info *info) {
+    struct pcap_trace trace;
+    struct pcap_batch_hdr hdr;
+    const unsigned char *packet;
+    int budget = PKTGEN_FLOW_BEATS;
+    if (pcap_map_file(filename, &trace) < 0) {
+        exit(-1);
+    }
+    if (imix == NULL) {
+        while ((packet = pcap_next_record(&trace, &hdr)) != NULL) {
+            if (flow_beats(hdr.caplen) > budget) {
+                PRINT_WRAN("%s: flow buffer full after %lu packets\n", filename, info->packet_count);
+                break;
+            }
+            budget -= flow_beats(hdr.caplen);
+            mem_copy(packet, hdr.caplen);
+            info->byte_count += hdr.len;
+            info->packet_count ++;
+        }
+        pcap_unmap_file(&trace);
+        return;
+    }
+
+    const unsigned char *tmpl = pcap_next_record(&trace, &hdr);
+    if (tmpl == NULL) {
+        PRINT_ERR("%s: empty trace\n", filename);
+        exit(-1);
+    }
+    int sizes[16], weights[16], credit[16];
+    int n = 0, total = 0, cycle_beats = 0;
+    char *spec = strdup(imix);
+    for (char *tok = strtok(spec, ","); tok && n < 16; tok = strtok(NULL, ",")) {
+        char *x = strchr(tok, 'x');
+        sizes[n] = atoi(tok);
+        weights[n] = x ? atoi(x + 1) : 1;
+        if (sizes[n] < 60 || sizes[n] > 9000 || weights[n] <= 0) {
+            PRINT_ERR("bad imix entry %s\n", tok);
+            exit(-1);
+        }
+        credit[n] = 0;
+        total += weights[n];
+        cycle_beats += weights[n] * flow_beats(sizes[n]);
+        n++;
+    }
+    free(spec);
+    if (n == 0 || cycle_beats > budget) {
+        PRINT_ERR("imix %s does not fit in %d beats\n", imix, budget);
+        exit(-1);
+    }
+    unsigned char *buff = (unsigned char *)malloc(9000);
+    for (int rounds = budget / cycle_beats; rounds > 0; rounds--) {
+        for (int k = 0; k < total; k++) {
+            int best = 0;
+            for (int i = 0; i < n; i++) {
+                credit[i] += weights[i];
+                if (credit[i] > credit[best])
+                    best = i;
+            }
+            credit[best] -= total;
+            resize_packet(tmpl, hdr.caplen, buff, sizes[best]);
+            mem_copy(buff, sizes[best]);
+            info->byte_count += sizes[best];
+            info->packet_count ++;
+        }
+    }
+    free(buff);
+    pcap_unmap_file(&trace);
+}
@@ -28,6 +28,30 @@ struct pcap_trace_info {
     unsigned long long byte_count;
 };
 
+/* pcap file mapped read-only, records are walked in place */
+struct pcap_trace {
+    const unsigned char *base;
+    size_t size;
+    size_t offset;      /* next record */
+    int swapped;        /* file written on a host of other endianness */
+};
+
+/* record header in a batch buffer: one 16-byte beat in host byte order,
+ * followed by the packet padded to the next 16 bytes */
+struct pcap_batch_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+#define BATCH_BEAT_BYTES 16
+
+/* must match PktGenFlowDepth and TokenFracBits in bsv/library/PktGen.bsv */
+#define PKTGEN_FLOW_BEATS 1024
+#define PKTGEN_TOKEN_FRAC_BITS 12
+#define PKTGEN_BYTES_PER_CYCLE 8
+
 //struct write_pcap_desc {
 //  pcap_t              *pdesc;
 //  pcap_dumper_t       *pdumper;
@@ -41,7 +65,13 @@ struct pcap_trace_info {
 void mem_copy(const void *buff, int length);
 void load_pcap_file(const char *filename, struct pcap_trace_info *);
 void inject_pcap_file(const void *buff);
+int pcap_map_file(const char *filename, struct pcap_trace *trace);
+void pcap_unmap_file(struct pcap_trace *trace);
+const unsigned char *pcap_next_record(struct pcap_trace *trace, struct pcap_batch_hdr *hdr);
+size_t pcap_fill_batch(struct pcap_trace *trace, char *buff, size_t size, struct pcap_trace_info *info);
 const char* get_exe_name(const char* argv0);
 int compute_idle (const struct pcap_trace_info *info, double rate, double link_speed);
+void load_pcap_flow(const char *filename, const char *imix, struct pcap_trace_info *info);
+uint32_t compute_flow_rate(double rate, double link_speed);
 
 #endif
@@ -0,0 +1,128 @@
+/* Copyright (c) 2016 Cornell University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SONIC_RING_H_
+#define _SONIC_RING_H_
+
+#include <atomic>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Receive ring shared by the portal indication thread (producer) and the
+ * writer thread (consumer). Beats are assembled in place in a preallocated
+ * slot, and the slot is published by advancing head once eop is seen.
+ * No locks on the fast path: the consumer only sleeps on 'wakeup' when the
+ * ring is empty, and the producer only posts it when the consumer asked to.
+ */
+
+#define RX_RING_SLOTS 4096      /* power of two */
+#define RX_SLOT_SIZE  9216      /* jumbo frame */
+
+struct rx_slot {
+    struct timeval ts;
+    uint32_t caplen;
+    uint32_t len;
+    unsigned char data[RX_SLOT_SIZE];
+};
+
+struct rx_ring {
+    struct rx_slot *slots;
+    /* written by producer */
+    std::atomic<uint64_t> head __attribute__((aligned(64)));
+    /* written by consumer */
+    std::atomic<uint64_t> tail __attribute__((aligned(64)));
+    std::atomic<bool> sleeping;
+    sem_t wakeup;
+    unsigned long full_waits;
+};
+
+static inline void rx_ring_init(struct rx_ring *ring) {
+    ring->slots = (struct rx_slot *)calloc(RX_RING_SLOTS, sizeof(struct rx_slot));
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->sleeping.store(false);
+    ring->full_waits = 0;
+    sem_init(&ring->wakeup, 0, 0);
+}
+
+/* producer: slot for the packet being received, waits for the writer when
+ * the ring is full rather than dropping */
+static inline struct rx_slot *rx_ring_current(struct rx_ring *ring) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == RX_RING_SLOTS) {
+        ring->full_waits++;
+        while (head - ring->tail.load(std::memory_order_acquire) == RX_RING_SLOTS)
+            sched_yield();
+    }
+    return &ring->slots[head & (RX_RING_SLOTS - 1)];
+}
+
+/* producer: append one beat, bytes past the slot are counted but not kept */
+static inline void rx_ring_append(struct rx_slot *slot, const void *data, uint32_t bytes) {
+    if (slot->caplen + bytes <= RX_SLOT_SIZE) {
+        memcpy(slot->data + slot->caplen, data, bytes);
+        slot->caplen += bytes;
+    } else if (slot->caplen < RX_SLOT_SIZE) {
+        memcpy(slot->data + slot->caplen, data, RX_SLOT_SIZE - slot->caplen);
+        slot->caplen = RX_SLOT_SIZE;
+    }
+    slot->len += bytes;
+}
+
+static inline void rx_ring_publish(struct rx_ring *ring) {
+    ring->head.fetch_add(1, std::memory_order_seq_cst);
+    if (ring->sleeping.load(std::memory_order_seq_cst) &&
+        ring->sleeping.exchange(false))
+        sem_post(&ring->wakeup);
+}
+
+/* consumer: number of packets ready, blocks while the ring is empty */
+static inline uint64_t rx_ring_wait(struct rx_ring *ring) {
+    for (;;) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t ready = ring->head.load(std::memory_order_acquire) - tail;
+        if (ready)
+            return ready;
+        ring->sleeping.store(true, std::memory_order_seq_cst);
+        if (ring->head.load(std::memory_order_seq_cst) != tail) {
+            /* raced with a publish, absorb its post if it made one */
+            if (!ring->sleeping.exchange(false))
+                sem_wait(&ring->wakeup);
+            continue;
+        }
+        sem_wait(&ring->wakeup);
+    }
+}
+
+static inline struct rx_slot *rx_ring_peek(struct rx_ring *ring, uint64_t i) {
+    return &ring->slots[(ring->tail.load(std::memory_order_relaxed) + i) & (RX_RING_SLOTS - 1)];
+}
+
+/* consumer: release n slots back to the producer */
+static inline void rx_ring_release(struct rx_ring *ring, uint64_t n) {
+    ring->tail.fetch_add(n, std::memory_order_release);
+}
+
+#endif
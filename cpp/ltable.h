@@ -0,0 +1,93 @@
+/* Copyright (c) 2016 Cornell University
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SONIC_TABLE_H_
+#define _SONIC_TABLE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Bulk load buffer for a @shadow table, sent with writeTableBatch.
+ * An entry is the packed {ReqT key, ReqT mask, RspT} of the table, least
+ * significant bit first, padded to 16-byte beats: the RspT at bit 0, the
+ * mask at value_bits and the key at key_bits + value_bits (see
+ * table_entry_key). BSV packs the first field of a struct in the most
+ * significant bits, so the last field of each sits lowest. A set mask bit
+ * is matched, exact match tables ignore the mask.
+ * A batch is the whole new table: the hardware clears the idle copy before
+ * loading it. It holds at most 'depth' entries of the table, entries past
+ * that are dropped and answered with an invalid table_entry_info.
+ */
+
+#define TABLE_BEAT_SIZE 16
+
+struct table_batch {
+    char *buff;
+    size_t size;
+    size_t used;
+    uint32_t entry_size;
+    uint32_t count;
+    int key_bits;
+    int value_bits;
+};
+
+static inline void table_batch_init(struct table_batch *batch, char *buff, size_t size,
+                                    int key_bits, int value_bits) {
+    int beats = (2 * key_bits + value_bits + 8 * TABLE_BEAT_SIZE - 1) / (8 * TABLE_BEAT_SIZE);
+    batch->buff = buff;
+    batch->size = size;
+    batch->used = 0;
+    batch->entry_size = beats * TABLE_BEAT_SIZE;
+    batch->count = 0;
+    batch->key_bits = key_bits;
+    batch->value_bits = value_bits;
+}
+
+/* zeroed entry to fill in, NULL once the buffer is full */
+static inline uint8_t *table_batch_next(struct table_batch *batch) {
+    if (batch->used + batch->entry_size > batch->size)
+        return NULL;
+    uint8_t *entry = (uint8_t *)batch->buff + batch->used;
+    memset(entry, 0, batch->entry_size);
+    batch->used += batch->entry_size;
+    batch->count++;
+    return entry;
+}
+
+/* store the low 'bits' (at most 64) bits of v at bit offset 'pos' of an entry */
+static inline void table_entry_set(uint8_t *entry, int pos, uint64_t v, int bits) {
+    for (int i = 0; i < bits; i++, pos++) {
+        if ((v >> i) & 1)
+            entry[pos / 8] |= 1 << (pos % 8);
+    }
+}
+
+/* bit offsets of the key and the mask of an entry, the value is at 0 */
+static inline int table_entry_key(const struct table_batch *batch) {
+    return batch->key_bits + batch->value_bits;
+}
+
+static inline int table_entry_mask(const struct table_batch *batch) {
+    return batch->value_bits;
+}
+
+#endif
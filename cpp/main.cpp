@@ -23,8 +23,10 @@
 #include "MainIndication.h"
 #include "MainRequest.h"
 #include "GeneratedTypes.h"
+#include "dmaManager.h"
 #include "lutils.h"
 #include "lpcap.h"
+#include "lring.h"
 #include <pcap.h> 
 #include <pthread.h>
 
@@ -32,30 +34,45 @@
 #define MAXBYTES2CAPTURE 2048 
 #define BUFFSIZE 4096
 #define LINK_SPEED 10
+// batched injection ring: slots are refilled while the others are in flight
+#define DMA_SLOTS 4
+#define DMA_SLOT_SIZE (1 << 20)
+
+enum { DEST_HOSTCHAN = 0, DEST_PKTGEN = 1, DEST_METAGEN = 2 };
+// pktgen flows, must match PktGenFlows in PktGen.bsv
+#define MAX_FLOWS 4
+#define FLOW_BURST_BYTES 2048
+
+struct flow_spec {
+    char *file;
+    double rate;
+    char *imix;
+};
 
 static MainRequestProxy *device = 0;
-char* pktbuf=NULL;
-char* p=NULL;
-int size = 0;
-static bool tosend = false;
+static struct rx_ring rx_ring;
+static struct rx_slot *rx_slot = NULL;
+// writer thread drains at most this many packets between flushes
+#define RX_BATCH 256
 
 bool hwpktgen = false;
 bool metagen = false;
 
 static sem_t sem_read_version;
+static sem_t sem_batch_done;
 
 extern void app_init(MainRequestProxy* device);
+// optional, programs that age out entries receive the index of every added
+// entry and the answers to <table>_read_entry here
+extern void app_table_entry(TableId id, uint32_t index, int valid, uint32_t hits) __attribute__((weak));
 
 
 void device_writePacketData(uint64_t* data, uint8_t* mask, int sop, int eop) {
     if (hwpktgen) {
-      fprintf(stderr, "write pktgen\n");
       device->writePktGenData(data, mask, sop, eop);
     } else if (metagen) {
-      fprintf(stderr, "write metadata\n");
       device->writeMetaGenData(data, mask, sop, eop);
     } else {
-      fprintf(stderr, "write hostchan\n");
       device->writePacketData(data, mask, sop, eop);
     }
 }
@@ -70,18 +87,28 @@ public:
     virtual void read_pktcap_perf_info_resp(PktCapRec a) {
         fprintf(stderr, "perf: pktcap data_bytes=%ld idle_cycle=%ld total_cycle=%ld\n", a.data_bytes, a.idle_cycles, a.total_cycles);
     }
+    virtual void writePacketBatchDone(uint32_t base, uint32_t cycles) {
+        sem_post(&sem_batch_done);
+    }
+    virtual void table_entry_info(const TableId id, const uint32_t index, const uint8_t valid, const uint32_t hits) {
+        if (app_table_entry)
+            app_table_entry(id, index, valid, hits);
+    }
     virtual void readPacketData(const uint64_t data, const uint8_t mask, const uint8_t sop, const uint8_t eop) {
-        //fprintf(stderr, "Rdata %016lx, mask %02x, sop %x eop %x\n", data, mask, sop, eop);
         if (sop == 1) {
-            pktbuf = (char *) malloc(4096);
-            p = pktbuf;
+            rx_slot = rx_ring_current(&rx_ring);
+            rx_slot->caplen = 0;
+            rx_slot->len = 0;
         }
-        memcpy(p, &data, 8);
-        int bits = (mask * 01001001001ULL & 042104210421ULL) % 017;
-        p += bits;
-        size += bits;
+        if (rx_slot == NULL) {
+            // joined in the middle of a packet
+            return;
+        }
+        rx_ring_append(rx_slot, &data, __builtin_popcount(mask));
         if (eop == 1) {
-            tosend = true;
+            gettimeofday(&rx_slot->ts, NULL);
+            rx_ring_publish(&rx_ring);
+            rx_slot = NULL;
         }
     }
     MainIndication(unsigned int id): MainIndicationWrapper(id) {}
@@ -126,24 +153,68 @@ void *captureThread(void * pcapt) {
     return NULL;
 }
 
-void *sendThread(void *pcapt) {
-    pcap_t *pt;
-    pt = (pcap_t *)pcapt;
+/* received packets go to a pcap file, an interface (e.g. tap or veth), or both */
+struct rx_sink {
+    pcap_dumper_t *dumper;
+    pcap_t *intf;
+};
+
+void *writerThread(void *arg) {
+    struct rx_sink *sink = (struct rx_sink *)arg;
     while (1) {
-        if (tosend) {
-            fprintf(stderr, "inject packet %d\n", size);
-            pcap_inject(pt, pktbuf, size);
-            tosend = false;
-            size = 0;
+        uint64_t ready = rx_ring_wait(&rx_ring);
+        if (ready > RX_BATCH)
+            ready = RX_BATCH;
+        for (uint64_t i = 0; i < ready; i++) {
+            struct rx_slot *slot = rx_ring_peek(&rx_ring, i);
+            if (sink->dumper) {
+                struct pcap_pkthdr hdr;
+                hdr.ts = slot->ts;
+                hdr.caplen = slot->caplen;
+                hdr.len = slot->len;
+                pcap_dump((u_char *)sink->dumper, &hdr, slot->data);
+            }
+            if (sink->intf && pcap_inject(sink->intf, slot->data, slot->caplen) < 0) {
+                PRINT_WRAN("inject: %s\n", pcap_geterr(sink->intf));
+            }
         }
-        usleep(100);
+        rx_ring_release(&rx_ring, ready);
+        if (sink->dumper)
+            pcap_dump_flush(sink->dumper);
     }
     return NULL;
 }
 
-void run_demo(char *intf, char *outf) {
-  pthread_t t_cap, t_snd;
-  pcap_t *handle = NULL, *handle2=NULL; 
+void start_writer(const char *outf, const char *outpcap) {
+    static struct rx_sink sink;
+    pthread_t t_wr;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    memset(errbuf,0,PCAP_ERRBUF_SIZE);
+
+    rx_ring_init(&rx_ring);
+    sink.dumper = NULL;
+    sink.intf = NULL;
+    if (outpcap) {
+        pcap_t *dead = pcap_open_dead(DLT_EN10MB, RX_SLOT_SIZE);
+        if ((sink.dumper = pcap_dump_open(dead, outpcap)) == NULL) {
+            fprintf(stderr, "ERROR: %s\n", pcap_geterr(dead));
+            exit(1);
+        }
+    }
+    if (outf) {
+        printf("Opening device %s\n", outf);
+        if ((sink.intf = pcap_open_live(outf, MAXBYTES2CAPTURE, 0, 512, errbuf)) == NULL) {
+            fprintf(stderr, "ERROR: %s\n", errbuf);
+            exit(1);
+        }
+    }
+    pthread_create(&t_wr, NULL, writerThread, (void*)&sink);
+    pthread_detach(t_wr);
+}
+
+void run_demo(char *intf) {
+  pthread_t t_cap;
+  pcap_t *handle = NULL;
   char errbuf[PCAP_ERRBUF_SIZE];
   memset(errbuf,0,PCAP_ERRBUF_SIZE); 
 
@@ -154,18 +225,7 @@ void run_demo(char *intf, char *outf) {
     exit(1);
   }
   pthread_create(&t_cap, NULL, captureThread, (void*)handle);
-
-  if (outf) {
-    printf("Opening device %s\n", outf); 
-    if ((handle2 = pcap_open_live(outf, MAXBYTES2CAPTURE, 0, 512, errbuf)) == NULL) {
-      fprintf(stderr, "ERROR: %s\n", errbuf);
-      exit(1);
-    }
-    pthread_create(&t_snd, NULL, sendThread, (void*)handle2);
-  }
-
   pthread_join(t_cap, NULL);
-  pthread_join(t_snd, NULL);
   /* Loop forever & call processPacket() for every received packet */
   //if (pcap_loop(pt, -1, processPacket, (u_char *)&count) == -1){
   //   fprintf(stderr, "ERROR: %s\n", pcap_geterr(pt) );
@@ -173,17 +233,56 @@ void run_demo(char *intf, char *outf) {
   //}
 }
 
+/* Stream a trace to the device through a dma ring instead of one portal
+ * call per beat. Records are packed straight from the mapped pcap file. */
+void inject_pcap_batched(const char *filename, struct pcap_trace_info *info) {
+    struct pcap_trace trace;
+    if (pcap_map_file(filename, &trace) < 0) {
+        exit(-1);
+    }
+    DmaManager *dma = platformInit();
+    size_t ring_size = DMA_SLOTS * DMA_SLOT_SIZE;
+    int fd = portalAlloc(ring_size, 0);
+    char *ring = (char *)portalMmap(fd, ring_size);
+    unsigned int ref = dma->reference(fd);
+    int dest = hwpktgen ? DEST_PKTGEN : (metagen ? DEST_METAGEN : DEST_HOSTCHAN);
+
+    sem_init(&sem_batch_done, 0, DMA_SLOTS);
+    int slot = 0;
+    for (;;) {
+        sem_wait(&sem_batch_done);
+        char *buff = ring + slot * DMA_SLOT_SIZE;
+        size_t used = pcap_fill_batch(&trace, buff, DMA_SLOT_SIZE, info);
+        if (used == 0) {
+            sem_post(&sem_batch_done);
+            break;
+        }
+        portalCacheFlush(fd, buff, used, 1);
+        device->writePacketBatch(ref, slot * DMA_SLOT_SIZE, used, dest);
+        slot = (slot + 1) % DMA_SLOTS;
+    }
+    for (int i = 0; i < DMA_SLOTS; i++) {
+        sem_wait(&sem_batch_done);
+    }
+    PRINT_INFO("injected %ld packets, %lld bytes\n", info->packet_count, info->byte_count);
+    pcap_unmap_file(&trace);
+}
+
 void usage (const char *program_name) {
     printf("%s: p4fpga tester\n"
      "usage: %s [OPTIONS] \n",
      program_name, program_name);
     printf("\nOther options:\n"
     " -p, --parser=FILE                pcap trace to run\n"
+    " -b, --batch                      inject pcap trace through dma ring\n"
     " -I, --intf=interface             listen on interface\n"
+    " -O, --outf=interface             send received packets to interface\n"
+    " -w, --write=FILE                 write received packets to pcap file\n"
     " -r, --rate=x                     packet generation rate\n"
     " -n, --pktgen-count=n             packet generation count\n"
     " -i, --pktgen-intf=n              packet generation interface\n"
     " -v, --verbose=n                  set verbosity level\n"
+    " -f, --flow=FILE:RATE[:IMIX]      add a rate-shaped pktgen flow, e.g. udp.pcap:2.5:64x7,576x4,1500\n"
     " -m, --metagen=n                  generate metadata with <n> cycles gap in-between.\n"
     );
 }
@@ -191,13 +290,16 @@ void usage (const char *program_name) {
 int main(int argc, char **argv)
 {
     char *pcap_file=NULL;
-    char *intf=NULL, *outf=NULL; 
+    char *intf=NULL, *outf=NULL, *outpcap=NULL;
 
     double rate = 0.0;
     long tracelen = 0;
     long instance = 0; // pktgen instances
     long verbose = 0;
     long meta_gap = 0; // by default, pump metadata thru p4 pipeline with no gap
+    bool batch = false;
+    struct flow_spec flows[MAX_FLOWS];
+    int nflows = 0;
 
     struct pcap_trace_info pcap_info = {0, 0};
     MainIndication echoindication(IfcNames_MainIndicationH2S);
@@ -207,10 +309,13 @@ int main(int argc, char **argv)
 
     static struct option long_options [] = {
         {"help",                no_argument, 0, 'h'},
+        {"batch",               no_argument, 0, 'b'},
+        {"flow",                required_argument, 0, 'f'},
         {"metagen",             required_argument, 0, 'm'},
         {"pcap",                required_argument, 0, 'p'},
-//        {"intf",                required_argument, 0, 'I'},
-//        {"outf",                required_argument, 0, 'O'},
+        {"intf",                required_argument, 0, 'I'},
+        {"outf",                required_argument, 0, 'O'},
+        {"write",               required_argument, 0, 'w'},
         {"pktgen-rate",         required_argument, 0, 'r'},
         {"pktgen-count",        required_argument, 0, 'n'},
         {"pktgen-instance",     required_argument, 0, 'i'},
@@ -234,14 +339,36 @@ int main(int argc, char **argv)
             case 'p':
                 pcap_file = optarg;
                 break;
-//            case 'I':
-//                fprintf(stderr, "%s", optarg);
-//                intf = optarg;
-//                break;
-//            case 'O':
-//                fprintf(stderr, "%s", optarg);
-//                outf = optarg;
-//                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'f': {
+                if (nflows == MAX_FLOWS) {
+                    PRINT_ERR("at most %d flows\n", MAX_FLOWS);
+                    exit(1);
+                }
+                struct flow_spec *f = &flows[nflows++];
+                /* tokenize a copy, optarg is printed if the spec is bad */
+                char *spec = strdup(optarg);
+                f->file = strtok(spec, ":");
+                char *r = strtok(NULL, ":");
+                f->rate = r ? strtod(r, NULL) : 0.0;
+                f->imix = strtok(NULL, ":");
+                if (f->file == NULL || f->rate <= 0.0) {
+                    PRINT_ERR("bad flow %s, expect FILE:RATE[:IMIX]\n", optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case 'I':
+                intf = optarg;
+                break;
+            case 'O':
+                outf = optarg;
+                break;
+            case 'w':
+                outpcap = optarg;
+                break;
             case 'r':
                 rate = strtod(optarg, NULL);
                 break;
@@ -263,6 +390,9 @@ int main(int argc, char **argv)
         }
     }
 
+    // drain packets returned by the device
+    start_writer(outf, outpcap);
+
     device->set_verbosity(verbose);
 
     // application specific call
@@ -274,8 +404,26 @@ int main(int argc, char **argv)
     sleep(3);
 
     // if specified intf on command line
-    if (intf && outf) {
-      run_demo(intf, outf);
+    if (intf) {
+      run_demo(intf);
+    }
+
+    // one trace per flow, each shaped to its own rate
+    if (nflows) {
+      hwpktgen = true;
+      for (int i = 0; i < nflows; i++) {
+        struct pcap_trace_info flow_info = {0, 0};
+        device->pktgen_load_flow(i);
+        load_pcap_flow(flows[i].file, flows[i].imix, &flow_info);
+        device->pktgen_set_flow(i, compute_flow_rate(flows[i].rate, LINK_SPEED),
+                                FLOW_BURST_BYTES << PKTGEN_TOKEN_FRAC_BITS);
+        fprintf(stderr, "flow %d: %s %lu packets %llu bytes at %.2f Gbps\n", i, flows[i].file,
+                flow_info.packet_count, flow_info.byte_count, flows[i].rate);
+      }
+      device->pktgen_load_flow(0);
+      device->pktcap_start(tracelen);
+      device->pktgen_start_flows(tracelen, instance);
+      hwpktgen = false;
     }
 
     // load pcap to pktgen
@@ -283,7 +431,11 @@ int main(int argc, char **argv)
 
     if (pcap_file) {
       fprintf(stderr, "Attempts to read pcap file %s\n", pcap_file);
-      load_pcap_file(pcap_file, &pcap_info);
+      if (batch) {
+        inject_pcap_batched(pcap_file, &pcap_info);
+      } else {
+        load_pcap_file(pcap_file, &pcap_info);
+      }
     }
 
     if (hwpktgen) {